@@ -0,0 +1,52 @@
+#include "mbed.h"
+#include "CmdConsole.h"
+
+// Command consoles run from an EventQueue (see CmdConsole.h)
+
+CmdConsole::CmdConsole(SerialMux &port, EventQueue &queue, void (*process)(CmdLine &cl, const char *line, size_t len), const char *prompt)
+    : CmdLine(&port), port(port), queue(queue)
+{
+    this->process=process;
+    this->prompt=prompt;
+    posted=false;
+    lines=0;
+    port.set_wake(0xFFFF,'\n');   // only a whole line (or a full buffer) is worth a call
+    port.sigio(callback(this,&CmdConsole::post));
+}
+
+void CmdConsole::start(void)
+{
+    print(prompt);
+    post();
+}
+
+void CmdConsole::post(void)
+{
+    // if the queue is full, the next line that comes in tries again
+    if (!posted.exchange(true) && !queue.call(this,&CmdConsole::service)) posted=false;
+}
+
+void CmdConsole::service(void)
+{
+    char cmdline[MAXLINE+1];
+    const char *p1, *p2;
+    size_t n1, n2, n;
+    posted=false;   // a line that comes in from here on posts us again
+    n=port.scan('\n',MAXLINE,false);
+    if (!n) return;   // not a whole line yet
+    port.peek(&p1,&n1,&p2,&n2);
+    if (n<=n1)
+    {
+        process(*this,p1,n);   // right out of the input buffer
+        port.consume(n);
+    }
+    else
+    {
+        n=port.read_until(cmdline,n,'\n');   // it wraps around the end of the buffer
+        process(*this,cmdline,n);
+    }
+    lines++;
+    print(prompt);
+    // another line waiting goes to the back of the queue so the other consoles get a turn
+    if (port.scan('\n',MAXLINE,false)) post();
+}
@@ -0,0 +1,51 @@
+#ifndef __CMDCONSOLE_H
+#define __CMDCONSOLE_H
+
+#include "mbed.h"
+#include "SerialMux.h"
+#include "CmdParam.h"
+#include <atomic>
+
+/* A command console that doesn't need a thread of its own
+
+cmdloop blocks on its channel, so every console it runs needs a thread and a stack. A
+CmdConsole instead has the mux post a call to an EventQueue when a whole line is waiting,
+and the line is parsed by whatever thread dispatches that queue. Any number of consoles
+can share one queue (and one thread):
+
+    EventQueue cmdQueue(4*EVENTS_EVENT_SIZE);   // room for one event per console
+    CmdConsole console(cmdConsole,cmdQueue,cmdprocess), console2(otherConsole,cmdQueue,cmdprocess);
+    ...
+    command.start(callback(&cmdQueue,&EventQueue::dispatch_forever));
+    console.start();   // prompt (say, once USB is connected)
+
+cmdprocess runs one line, usually CmdParam::process with your table. The console is the
+CmdLine it gets, so replies go back on the same channel. Construct consoles before the link
+starts (they take the channel's sigio) and don't read the channel anywhere else.
+
+Each console has at most one event in the queue and runs one line per event, so a console
+with a lot of input takes turns with the others. A command holds up every console on its
+queue while it runs, so keep slow work (and writes that wait on a full channel) elsewhere.
+Lines are up to MAXLINE bytes, or the input buffer's size if that is smaller.
+*/
+
+class CmdConsole : public CmdLine
+{
+public:
+    enum { MAXLINE=256 };
+    CmdConsole(SerialMux &port, EventQueue &queue, void (*process)(CmdLine &cl, const char *line, size_t len), const char *prompt="? ");
+    // print the prompt and take any lines that are already waiting
+    void start(void);
+    unsigned long get_lines(void) { return lines; }
+protected:
+    SerialMux &port;
+    EventQueue &queue;
+    void (*process)(CmdLine &cl, const char *line, size_t len);
+    const char *prompt;
+    std::atomic<bool> posted;   // service is in the queue
+    unsigned long lines;
+    void post(void);      // put service in the queue (any thread; this is the channel's sigio)
+    void service(void);   // the queue's thread: run a line if one is waiting
+};
+
+#endif
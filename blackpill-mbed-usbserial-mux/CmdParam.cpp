@@ -1,4 +1,4 @@
-// Command processor parsing class using C++ strings
+// Command processor parsing class
 // Public domain -- Williams
 
 // For demo:
@@ -27,10 +27,30 @@ The second string is what the built in help processor prints for help.
 The 4th argument is a function name and the 5th is a void pointer that will be
 sent to the function. Functions look like:
 
-void help(unsigned int id, void *arg, const char *p);
+void help(unsigned int id, void *arg, CmdLine &cl);
 
-Here, id will be 1, arg will be NULL, and p will be whatever is left
-on the command line after eating the help. 
+Here, id will be the entry's index in the table (0 for help), arg will be NULL,
+and cl is the line being parsed, already past the command name. Pull the
+arguments with cl.getuint(), cl.gettoken(), etc. and answer with cl.print().
+
+Each console makes its own CmdLine (with the stream to answer on) and passes
+it to process. The tokens are pointers into the line you passed, so process
+never copies it or allocates memory, and consoles on different threads
+don't get in each other's way.
+
+An entry can also just be a variable. Give its type and leave the function NULL:
+
+   { 4, "rate", "Sample rate in ms", NULL, &rate, CmdParam::PARAM_UINT, 1, 60000 },
+   { 5, "name", "Station name", NULL, name, CmdParam::PARAM_STR, sizeof(name) },
+
+"rate 100" checks that 100 is a number from 1 to 60000 and stores it, and
+"rate" by itself prints it. A PARAM_STR takes one token that has to fit the
+buffer (the 7th argument is its size, with the 0).
+
+The constructor is constexpr, so a constexpr table (names, docs, and all)
+lives in flash instead of being built in RAM at startup. A constexpr table
+can also have a CmdHash (see CmdParam.h) so process finds a command with a
+perfect hash instead of looking at the names one at a time.
 
 A few ideas:
 You can pass anything that will fit in a void pointer and cast it.
@@ -48,113 +68,240 @@ You can subclass to change error handling, help messages, etc.
 #include <mbed.h>
 #include <cstdio>
 #include <stdlib.h>
+#include <ctype.h>
+#include <limits.h>
 
 #include "CmdParam.h"
-#include "cmds.h"  // we need cmdtty
 
 // Test for empty entry
-#define ISEMPTY(x) (x.length()==0)
+#define ISEMPTY(x) ((x).isEnd())
 
-// Static variables here
-std::string CmdParam::current;
-unsigned int CmdParam::index;
-std::string CmdParam::sep=" \t\r\n" ;
-void (*CmdParam::notfoundfunc)(const char *,const char *)=CmdParam::notfound;
-void (*CmdParam::printfunc)(const char *)=CmdParam::print;
+bool CmdToken::copy(char *buf, size_t size) const
+{
+  size_t n=len<size?len:size-1;
+  if (!size) return false;
+  memcpy(buf,p,n);
+  buf[n]='\0';
+  return n==len;
+}
 
+// Digits of a token, base 10, 16 (0x) or 8 (leading 0) like strtoul with base 0
+// false if it isn't all digits or it is more than max
+static bool parseuint(const char *p, size_t len, unsigned long max, unsigned long *v)
+{
+  unsigned base=10;
+  size_t i=0;
+  *v=0;
+  if (len>1 && p[0]=='0')
+    {
+      base=8;
+      i=1;
+      if ((p[1]|0x20)=='x')
+	{
+	  base=16;
+	  i=2;
+	  if (len==2) return false;
+	}
+    }
+  if (i>=len) return false;
+  for (;i<len;i++)
+    {
+      unsigned c=p[i]|0x20, d;   // | 0x20 makes letters lower case (and leaves digits alone)
+      if (c>='0' && c<='9') d=c-'0';
+      else if (c>='a' && c<='f') d=c-'a'+10;
+      else return false;
+      if (d>=base || *v>(max-d)/base) return false;
+      *v=*v*base+d;
+    }
+  return true;
+}
 
 // Get float from current command line
-// *valid==false if not present and safe to set valid to NULL (default)
-float CmdParam::getfloat(bool *valid)
+// *valid==false if not present or not a number and safe to set valid to NULL (default)
+float CmdLine::getfloat(bool *valid)
 {
-  float f=0.0;
-  bool tvalid;
-  std::string token=gettoken(&tvalid);
+  float f=0.0, scale=1.0;
+  int exp=0, eexp=0;
+  bool tvalid, neg=false, digits=false;
+  CmdToken token=gettoken(&tvalid);
+  size_t i=0;
+  if (tvalid && i<token.len && (token.p[i]=='-' || token.p[i]=='+')) neg=token.p[i++]=='-';
+  for (;tvalid && i<token.len && isdigit(token.p[i]);i++,digits=true) f=f*10+(token.p[i]-'0');
+  if (tvalid && i<token.len && token.p[i]=='.')
+    for (i++;i<token.len && isdigit(token.p[i]);i++,digits=true,exp--) f=f*10+(token.p[i]-'0');
+  if (tvalid && digits && i<token.len && (token.p[i]|0x20)=='e')
+    {
+      bool eneg=false;
+      i++;
+      if (i<token.len && (token.p[i]=='-' || token.p[i]=='+')) eneg=token.p[i++]=='-';
+      if (i>=token.len) digits=false;
+      for (;i<token.len && isdigit(token.p[i]);i++) if (eexp<100) eexp=eexp*10+(token.p[i]-'0');
+      exp+=eneg?-eexp:eexp;
+    }
+  if (!digits || i!=token.len) tvalid=false;
   if (valid) *valid=tvalid;
-  if (tvalid) f=std::stof(token);
-  return f;
+  if (!tvalid) return 0.0;
+  // one multiply or divide at the end keeps the rounding down
+  for (int e=exp<0?-exp:exp;e>0;e--) scale*=10;
+  f=exp<0?f/scale:f*scale;
+  return neg?-f:f;
 }
 
 // Get int from current command line
-// *valid==false if not present and safe to set valid to NULL (default)
-int CmdParam::getint(bool *valid)
+// *valid==false if not present or not a number and safe to set valid to NULL (default)
+int CmdLine::getint(bool *valid)
 {
-  int f=0;
-  bool tvalid;
-  std::string token=gettoken(&tvalid);
+  unsigned long f=0;
+  bool tvalid, neg=false;
+  CmdToken token=gettoken(&tvalid);
+  if (tvalid && (token.p[0]=='-' || token.p[0]=='+'))
+    {
+      neg=token.p[0]=='-';
+      token.p++;
+      token.len--;
+    }
+  // a negative number can go one further (to INT_MIN)
+  if (tvalid) tvalid=parseuint(token.p,token.len,neg?(unsigned long)INT_MAX+1:INT_MAX,&f);
   if (valid) *valid=tvalid;
-  if (tvalid) f=std::stoi(token,NULL,0);
-  return f;
+  if (!tvalid) return 0;
+  if (neg && f) return -(int)(f-1)-1;   // -(int)f would overflow for INT_MIN
+  return (int)f;
 }
 // Get uint from current command line
-// *valid==false if not present and safe to set valid to NULL (default)
-unsigned int CmdParam::getuint(bool *valid)
+// *valid==false if not present or not a number and safe to set valid to NULL (default)
+unsigned int CmdLine::getuint(bool *valid)
 {
-  unsigned int f=0;
+  unsigned long f=0;
   bool tvalid;
-  std::string token=gettoken(&tvalid);
+  CmdToken token=gettoken(&tvalid);
+  if (tvalid) tvalid=parseuint(token.p,token.len,UINT_MAX,&f);
   if (valid) *valid=tvalid;
-  if (tvalid) f=std::stoul(token,NULL,0);
-  return f;
+  return tvalid?f:0;
+}
+
+// A 0 in the line counts as a separator, so a token never has one in it
+bool CmdLine::atend(void)
+{
+  while (index<len && strchr(sep,line[index])) index++;
+  return index==len;
 }
 
 // Get token from current command line
 // *valid==false if not present and safe to set valid to NULL (default)
-std::string CmdParam::gettoken(bool *valid)
+CmdToken CmdLine::gettoken(bool *valid)
 {
-  std::string token;
+  CmdToken token;
   size_t n1;
   if (valid) *valid=false;
-  n1=current.find_first_not_of(sep,index);
-  if (n1==std::string::npos) return token;  // all separators or end of string
+  atend();   // skip separators
+  n1=index;
+  token.p=line+n1;
+  token.len=0;
+  if (n1==len) return token;  // all separators or end of line
   if (valid) *valid=true;
-  index=current.find_first_of(sep,n1);  // find end of token
-  token=current.substr(n1,(index!=std::string::npos)?index-n1:std::string::npos);
+  for (;index<len && !strchr(sep,line[index]);index++);  // find end of token
+  token.len=index-n1;
   return token;
 }
 
 // Take a table and a command line and make it happen
 // Note you could have a command that sets a mode that makes
 // a different table active, for example
-void CmdParam::process(CmdParam *table, const char *cmdline)
+void CmdParam::process(const CmdParam *table, CmdLine &cl, const char *cmdline)
+{
+  process(table,cl,cmdline,strlen(cmdline));
+}
+
+void CmdParam::process(const CmdParam *table, CmdLine &cl, const char *line, size_t len)
 {
-  std::string ccmd;
-    bool valid;
-    current=cmdline;   // current line
-    index=0;
-    ccmd=gettoken(&valid);  // get the command
-    if (!valid)
-      {
-	printfunc("Unknown error:");
-	printfunc(cmdline);
-	return;
-      }
+  CmdToken ccmd;
+    if (!start(cl,line,len,&ccmd)) return;   // blank line
     // search table
-    for (int i=0;table[i].cmdname.length()!=0;i++)
+    for (int i=0;!ISEMPTY(table[i]);i++)
     {
       if (ccmd==table[i].cmdname)
         {
             // found
-	    current=cmdline;
-            table[i].fp(i,table[i].arg,current.substr(index).c_str());
+            table[i].run(i,cl);
             return;
         }
     }
     // not found
-    notfoundfunc(cmdline, ccmd.c_str());
+    cl.notfound(ccmd);
 }
 
-void CmdParam::notfound(const char *cmdline, const char *cmd)
-    {
-      printfunc("Not found: ");
-      printfunc(cmd);
-      printfunc("\r\n"); 
-    };
+bool CmdParam::start(CmdLine &cl, const char *line, size_t len, CmdToken *cmd)
+{
+  bool valid;
+  cl.start(line,len);
+  *cmd=cl.gettoken(&valid);  // get the command
+  return valid;
+}
+
+void CmdParam::run(unsigned int i, CmdLine &cl) const
+{
+  if (fp) fp(i,arg,cl);
+  else if (ptype!=PARAM_NONE) setparam(cl);
+}
 
+// A typed entry without a function: no argument shows the value, otherwise
+// the argument has to fit the type and range (or buffer) to be stored
+void CmdParam::setparam(CmdLine &cl) const
+{
+  char msg[64];
+  bool valid;
+  if (cl.atend())
+    {
+      if (ptype==PARAM_UINT) snprintf(msg,sizeof(msg),"%s %u\r\n",cmdname,*(unsigned int *)arg);
+      else snprintf(msg,sizeof(msg),"%s ",cmdname);
+      cl.print(msg);
+      if (ptype==PARAM_STR)
+	{
+	  cl.print((const char *)arg);
+	  cl.print("\r\n");
+	}
+      return;
+    }
+  if (ptype==PARAM_UINT)
+    {
+      unsigned int v=cl.getuint(&valid);
+      if (!valid)
+	{
+	  cl.print("Need a number\r\n");
+	  return;
+	}
+      if (v<getMin() || v>getMax())
+	{
+	  snprintf(msg,sizeof(msg),"Out of range (%u to %u)\r\n",getMin(),getMax());
+	  cl.print(msg);
+	  return;
+	}
+      *(unsigned int *)arg=v;
+    }
+  else
+    {
+      CmdToken tkn=cl.gettoken();
+      if (tkn.len>=plo)
+	{
+	  cl.print("Too long\r\n");
+	  return;
+	}
+      tkn.copy((char *)arg,plo);
+    }
+  cl.print("OK\r\n");
+}
 
-void CmdParam::print(const char *msg)
+void CmdLine::notfound(CmdToken cmd)
     {
-        cmdtty->puts(msg);
+      char name[33];
+      cmd.copy(name,sizeof(name));
+      print("Not found: ");
+      print(name);
+      print("\r\n");
     };
 
 
+void CmdLine::print(const char *msg)
+    {
+        if (out) out->puts(msg);
+    };
@@ -1,72 +1,227 @@
 #ifndef __CMDParam_H
 #define __CMDParam_H
 
-/* Command processor parsing class using C++ Strings
+/* Command processor parsing class
    Public domain -- Williams
 
-   See cmdparm.cpp for more info 
+   See cmdparm.cpp for more info
 */
 
-#include <string>
+#include "mbed.h"
+#include <string.h>
+#include <stdint.h>
+
+// A piece of a command line. It points into the caller's buffer, so there is no 0 at the end
+struct CmdToken
+{
+    const char *p;
+    size_t len;
+    // stops at the end of s, so it never reads past a shorter name
+    bool operator==(const char *s) const
+    {
+        size_t i=0;
+        while (i<len && s[i] && s[i]==p[i]) i++;
+        return i==len && s[i]=='\0';
+    }
+    bool operator!=(const char *s) const { return !(*this==s); }
+    // copy out with a 0 (false if it doesn't fit; buf still gets what does)
+    bool copy(char *buf, size_t size) const;
+};
+
+// One command line being parsed: the line, where we are in it, the separators, and where
+// output goes. Each console has its own, so any number of them can parse at once, and
+// nothing is copied or allocated. You can subclass to change the output or error handling
+class CmdLine
+{
+    protected:
+  const char *line;   // the caller's buffer
+  size_t len;
+  size_t index;       // our position in the line
+  const char *sep;    // seperators (default " \t\r\n")
+  Stream *out;        // where print goes (can be NULL)
+    public:
+  CmdLine(Stream *s=NULL) : line(""), len(0), index(0), sep(" \t\r\n"), out(s) {};
+  virtual ~CmdLine() {};
+  // start on a line (it doesn't have to end in a 0, but has to stay put while we work)
+  void start(const char *cmdline, size_t n) { line=cmdline; len=n; index=0; };
+  // Separators for this line
+  void setseperator(const char *set) { sep=set; };
+  Stream *getStream(void) { return out; };
+  virtual void print(const char *msg);
+  virtual void notfound(CmdToken cmd);
+  // Get token/float/int/uint or all the way to end of line (eos)
+  // The numbers are parsed right in the line; *valid==false if missing or not a number
+  CmdToken gettoken(bool *valid=NULL);
+  float getfloat(bool *valid=NULL);
+  int getint(bool *valid=NULL);
+  unsigned int getuint(bool *valid=NULL);
+  CmdToken geteos(void) { CmdToken t={line+index,len-index}; return t; };
+  // Nothing left but separators?
+  bool atend(void);
+};
+
+template <size_t N> class CmdHash;
 
   class CmdParam
 {
     protected:
-  std::string cmdname;  // command name
-  std::string cmddoc;   // help string
+  const char *cmdname;  // command name
+  const char *cmddoc;   // help string
   unsigned int id;      // ID
   void *arg;            // argument to callback
+  int ptype;            // what arg points to (PARAM_xxx)
+  unsigned int plo;     // PARAM_STR: size of the buffer (with its 0); PARAM_UINT: smallest value
+  unsigned int phi;     // PARAM_UINT: largest value (0 for no limit)
   // the callback function
-  void (*fp)(unsigned int id, void *arg, const char *cmdline);
-  // current command we are processing
-    static std::string current;
-  // seperators (default " \t\r\n")
-    static std::string sep;
-  // Our current position in the current line
-    static unsigned int index;
-    // By making these pointers we can change them in a derived constructor
-    static void (*notfoundfunc)(const char *cmdline, const char *cmd);
-    static void (*printfunc)(const char *msg);
+  void (*fp)(unsigned int id, void *arg, CmdLine &cl);
+  // what a typed entry without a function does
+  void setparam(CmdLine &cl) const;
     public:
-    // constructor (usually in a literal array; see demo 
- CmdParam(unsigned int iid, const char *name,const char *doc,void (*func)(unsigned int, void *,const char *),void *farg) : cmdname(name), cmddoc(doc), fp(func), id(iid), arg(farg) {};
+    // Parameter types. A command whose arg is a variable can say so and then MuxRPC
+    // can get and set it directly (PARAM_NONE commands are text only). If such an entry
+    // has no function, the command parses, checks, and stores its argument itself
+    enum { PARAM_NONE=0, PARAM_UINT, PARAM_STR };
+    // constructor (usually in a literal array; see demo
+    // lo and hi are a PARAM_UINT's range or a PARAM_STR's buffer size (lo)
+ constexpr CmdParam(unsigned int iid, const char *name,const char *doc,void (*func)(unsigned int, void *,CmdLine &),void *farg,int type=PARAM_NONE,unsigned int lo=0,unsigned int hi=0) : cmdname(name), cmddoc(doc), fp(func), id(iid), arg(farg), ptype(type), plo(lo), phi(hi) {};
     // Process a table and a command line
     // You can have different tables for different command lines
-    static void process(CmdParam *table, const char *cmdline);
-    // you can override these two for better control by setting
-    // printfunc and notfoundfunc
-    static void print(const char *msg);
-    static void notfound(const char *cmdline, const char *cmd);
+    static void process(const CmdParam *table, CmdLine &cl, const char *cmdline);
+    // Same but the line doesn't have to end in a 0 (say, it is still in a receive buffer)
+    static void process(const CmdParam *table, CmdLine &cl, const char *cmdline, size_t len);
+    // Same but find the command with a perfect hash of the table (see CmdHash)
+    template <size_t N> static void process(const CmdHash<N> &hash, CmdLine &cl, const char *cmdline, size_t len)
+    {
+      CmdToken ccmd;
+      int i;
+      if (!start(cl,cmdline,len,&ccmd)) return;
+      if ((i=hash.find(ccmd))<0) cl.notfound(ccmd);
+      else hash.table[i].run(i,cl);
+    }
+    // Start a line and get the command (false for a blank line)
+    static bool start(CmdLine &cl, const char *cmdline, size_t len, CmdToken *cmd);
+    // Do this entry's command (i is its index)
+    void run(unsigned int i, CmdLine &cl) const;
     // Get the doc string
-  std::string &getDoc(void) { return cmddoc; };
+  constexpr const char *getDoc(void) const { return cmddoc; };
+  // What the binary RPC needs to know
+  constexpr const char *getName(void) const { return cmdname; };
+  constexpr int getType(void) const { return ptype; };
+  constexpr unsigned int getSize(void) const { return plo; };
+  constexpr unsigned int getMin(void) const { return plo; };
+  constexpr unsigned int getMax(void) const { return phi?phi:~0u; };
+  constexpr void *getArg(void) const { return arg; };
+  // End of table?
+  constexpr bool isEnd(void) const { return !cmdname || !*cmdname; };
 
   // Helper so you can use help directly
-  static void help(unsigned id, void *arg, const char *cmdline)
+  static void help(unsigned id, void *arg, CmdLine &cl)
   {
-    help((CmdParam *)arg);
+    help((const CmdParam *)arg,cl);
   }
-  
+
   // Built-in help command
-  static void help(CmdParam *table) 
+  static void help(const CmdParam *table, CmdLine &cl)
     {
         unsigned i;
-        for (i=0;table[i].cmdname.length()!=0;i++)
+        for (i=0;!table[i].isEnd();i++)
 	  {
-	    printfunc(table[i].cmdname.c_str());
-	    printfunc(" - ");
-	    printfunc(table[i].cmddoc.c_str());
-	    printfunc("\r\n");
+	    cl.print(table[i].cmdname);
+	    cl.print(" - ");
+	    cl.print(table[i].cmddoc);
+	    cl.print("\r\n");
 	  }
     };
-  // Separators for everything
-  static void setseperator(const char *set) { sep=set; }
-  // Get token/float/int/uint or all the way to end of string (eos)
-  static std::string gettoken(bool *valid=NULL);
-  static float getfloat(bool *valid=NULL);
-  static int getint(bool *valid=NULL);
-  static unsigned int getuint(bool *valid=NULL);
-  static std::string geteos(void) { return std::string(current,index); }
-  
+};
+
+// Entries in a table (not counting the end)
+#define CMDCOUNT(table) (sizeof(table)/sizeof((table)[0])-1)
+
+// Hash a name with a seed (FNV-1a, then a final mix so the low bits are good too)
+constexpr uint32_t cmdhashname(const char *p, size_t len, uint32_t seed)
+{
+  uint32_t h=(2166136261u^seed)*16777619u;
+  for (size_t i=0;i<len;i++) h=(h^(unsigned char)p[i])*16777619u;
+  return h^(h>>15);
+}
+
+constexpr size_t cmdnamelen(const char *p)
+{
+  size_t n=0;
+  while (p[n]) n++;
+  return n;
+}
+
+/* A perfect hash for a command table, worked out by the compiler
+
+   constexpr CmdParam commands[] = { ... };
+   constexpr CmdHash<CMDCOUNT(commands)> cmdhash(commands);
+   static_assert(cmdhash.ok,"can't hash the command table (same name twice?)");
+   ...
+   CmdParam::process(cmdhash,cl,line,len);
+
+   A name hashes to one of about N/2 buckets. Each bucket has a seed, picked here so that
+   hashing its names again with it puts every name in the table in a slot of its own, and
+   the slot holds the entry's index. So finding a command takes two hashes and one compare
+   however long the table is. Everything (table, seeds, and slots) is constant, so it all
+   stays in flash. Up to 255 entries.
+*/
+template <size_t N> class CmdHash
+{
+ public:
+  static constexpr size_t BUCKETS=N/2+1;
+  static constexpr size_t SLOTS=N<2?2:(size_t)1<<(32-__builtin_clz(N-1));   // power of 2 >= N
+  static constexpr uint8_t EMPTY=255;
+  const CmdParam *table;
+  uint8_t seed[BUCKETS];
+  uint8_t slot[SLOTS];
+  bool ok;
+
+  constexpr CmdHash(const CmdParam *t) : table(t), seed{}, slot{}, ok(N<EMPTY)
+  {
+    size_t len[N?N:1]={}, bucket[N?N:1]={}, count[BUCKETS]={}, most=0;
+    for (size_t i=0;i<SLOTS;i++) slot[i]=EMPTY;
+    for (size_t i=0;i<N && ok;i++)
+      {
+        ok=!t[i].isEnd();   // N is wrong if this trips
+        len[i]=cmdnamelen(t[i].getName());
+        bucket[i]=cmdhashname(t[i].getName(),len[i],0)%BUCKETS;
+        if (++count[bucket[i]]>most) most=count[bucket[i]];
+      }
+    if (ok) ok=t[N].isEnd();
+    // the biggest buckets first, while there is the most room
+    for (size_t size=most;size>0 && ok;size--)
+      for (size_t b=0;b<BUCKETS && ok;b++)
+        {
+          unsigned s=0;
+          if (count[b]!=size) continue;
+          ok=false;
+          for (s=1;s<256 && !ok;s++)
+            {
+              size_t i=0;
+              ok=true;
+              for (i=0;i<N && ok;i++)
+                if (bucket[i]==b)
+                  {
+                    size_t k=cmdhashname(t[i].getName(),len[i],s)%SLOTS;
+                    if (slot[k]!=EMPTY) ok=false;
+                    else slot[k]=i;
+                  }
+              if (ok) seed[b]=s;
+              else   // take back this try
+                for (size_t j=0;j<i;j++)
+                  if (bucket[j]==b && slot[cmdhashname(t[j].getName(),len[j],s)%SLOTS]==j)
+                    slot[cmdhashname(t[j].getName(),len[j],s)%SLOTS]=EMPTY;
+            }
+        }
+  }
+  // index of a command (-1 if there isn't one)
+  int find(CmdToken name) const
+  {
+    size_t k=cmdhashname(name.p,name.len,seed[cmdhashname(name.p,name.len,0)%BUCKETS])%SLOTS;
+    if (slot[k]==EMPTY || name!=table[slot[k]].getName()) return -1;
+    return slot[k];
+  }
 };
 
 #endif
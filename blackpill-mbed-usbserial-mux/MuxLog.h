@@ -0,0 +1,128 @@
+#ifndef __MUXLOG_H
+#define __MUXLOG_H
+
+#include "SerialMux.h"
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+/* Binary log records (formatted on the host)
+
+    MUXLOG(debugConsole,":%d Analog=%d.%d\r\n",n,a,b);
+
+does not format anything. The format string goes in its own section (muxlog_fmt) and the
+record that goes out on the channel is just where it is in that section plus the arguments:
+
+    len id(2) args...     len is the number of bytes after itself, id is little endian
+
+    integers, chars, bools, enums     varint: 7 bits a byte, low first, top bit set if more follow
+                                      (so 0-127 is 1 byte; negative 32 bit values take 5)
+    pointers                          varint
+    float, double                     4 byte float, little endian
+    char strings                      1 length byte then the characters (cut to fit)
+
+Records are at most 256 bytes. Each one goes out whole (write_whole) or not at all, so
+records never mix with other writers or get cut short. MUXLOG drops a record (log returns
+false) if a non-blocking channel has no room for it, or if it is longer than a set_mpsc
+channel's longest record (half its output buffer less 2 bytes). Use set_mpsc to log from
+several threads or an ISR, and give such a channel an output buffer of at least
+2*MuxLog::MAXREC+4 bytes so every record fits. If the arguments don't all fit, the ones that
+do go out and the host shows the record as short. The compiler still checks the arguments
+against the format like printf.
+
+The host needs the section to turn records back into text. With GCC:
+
+    arm-none-eabi-objcopy -O binary -j muxlog_fmt firmware.elf muxlog.fmt
+
+and give the file to ttymux with -F (see readme). The formats only match the build they
+came from, so extract the table every time you flash.
+*/
+
+// start of the section (the linker makes this for any section named like a C identifier)
+extern "C" const char __start_muxlog_fmt[];
+
+#define MUXLOG(port,fmt,...) do { \
+        static const char muxlog_fmt_[] __attribute__((section("muxlog_fmt"),used))=fmt; \
+        if (0) MuxLog::check(fmt, ##__VA_ARGS__); \
+        MuxLog::log(port,muxlog_fmt_-__start_muxlog_fmt, ##__VA_ARGS__); \
+    } while (0)
+
+class MuxLog
+{
+public:
+    static const int MAXREC=256;   // whole record including the length byte
+    // send a record (use MUXLOG, which also makes id); false if it was dropped
+    template<typename... A> static bool log(SerialMux &port, unsigned id, A... args)
+    {
+        char rec[MAXREC];
+        char *p=rec+3, *end=rec+MAXREC;
+        put(p,end,args...);
+        rec[0]=p-rec-1;
+        rec[1]=id;
+        rec[2]=id>>8;
+        return port.write_whole(rec,p-rec);
+    }
+    // never called; lets the compiler check the format
+    static void check(const char *fmt, ...) __attribute__((format(printf,1,2))) {}
+protected:
+    static void put(char *&p, char *&end) {}
+    template<typename T, typename... A> static void put(char *&p, char *&end, T v, A... rest)
+    {
+        putone(p,end,v);
+        put(p,end,rest...);
+    }
+    // if an argument does not fit it is left off, and so is everything after it (end=p),
+    // so the host never reads a later argument in its place
+    static void putvar(char *&p, char *&end, uint64_t v)
+    {
+        char *q=p;
+        for (;q<end;v>>=7)
+        {
+            *q++=(v&0x7f)|(v>0x7f?0x80:0);
+            if (v<=0x7f)
+            {
+                p=q;
+                return;
+            }
+        }
+        end=p;
+    }
+    template<typename T> static typename std::enable_if<std::is_integral<T>::value||std::is_enum<T>::value>::type
+    putone(char *&p, char *&end, T v)
+    {
+        putvar(p,end,sizeof(T)>4?(uint64_t)v:(uint32_t)v);
+    }
+    static void putone(char *&p, char *&end, double v)
+    {
+        float f=v;
+        uint32_t u;
+        memcpy(&u,&f,4);
+        if (end-p<4)
+        {
+            end=p;
+            return;
+        }
+        for (int i=0;i<4;i++,u>>=8) *p++=u;
+    }
+    template<typename T> static void putone(char *&p, char *&end, const T *v)
+    {
+        putvar(p,end,(uintptr_t)v);
+    }
+    // a string that doesn't all fit is cut, and fills the record
+    static void putone(char *&p, char *&end, const char *s)
+    {
+        int n=strlen(s);
+        if (n>end-p-1) n=end-p-1;
+        if (n<0)
+        {
+            end=p;
+            return;
+        }
+        *p++=n;
+        memcpy(p,s,n);
+        p+=n;
+    }
+    static void putone(char *&p, char *&end, char *s) { putone(p,end,(const char *)s); }
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include "mbed.h"
+#include "MuxRPC.h"
+
+// Binary parameter access over a mux channel (see MuxRPC.h for the protocol)
+
+MuxRPC::MuxRPC(SerialMux &port, const CmdParam *table) : port(port)
+{
+    this->table=table;
+    for (entries=0;!table[entries].isEnd();entries++);
+    requests=0;
+}
+
+static bool putvar(unsigned char *&q, unsigned char *end, uint32_t v)
+{
+    unsigned char *p=q;
+    for (;p<end;v>>=7)
+    {
+        *p++=(v&0x7f)|(v>0x7f?0x80:0);
+        if (v<=0x7f)
+        {
+            q=p;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool putstr(unsigned char *&q, unsigned char *end, const char *s, size_t n)
+{
+    if (n>255) n=255;
+    if ((size_t)(end-q)<n+2) return false;
+    *q++=MuxRPC::VAL_STR;
+    *q++=n;
+    memcpy(q,s,n);
+    q+=n;
+    return true;
+}
+
+static bool takevar(const unsigned char *&p, const unsigned char *end, uint32_t *v)
+{
+    *v=0;
+    for (int shift=0;p<end;shift+=7)
+    {
+        if (shift<32) *v|=(uint32_t)(*p&0x7f)<<shift;
+        if (!(*p++&0x80)) return true;
+    }
+    return false;
+}
+
+bool MuxRPC::putvalue(unsigned char *&q, unsigned char *end, const CmdParam &p)
+{
+    switch (p.getType())
+    {
+    case CmdParam::PARAM_UINT:
+        if (q>=end) return false;
+        *q++=VAL_UINT;
+        return putvar(q,end,*(unsigned int *)p.getArg());
+    case CmdParam::PARAM_STR:
+        return putstr(q,end,(const char *)p.getArg(),strnlen((const char *)p.getArg(),p.getSize()));
+    }
+    if (q>=end) return false;
+    *q++=VAL_NONE;
+    return true;
+}
+
+int MuxRPC::setvalue(const unsigned char *&p, const unsigned char *end, const CmdParam *param)
+{
+    uint32_t v;
+    const unsigned char *s;
+    if (p>=end) return -1;
+    switch (*p++)
+    {
+    case VAL_UINT:
+        if (!takevar(p,end,&v)) return -1;
+        if (!param) return RPC_NOTFOUND;
+        if (param->getType()!=CmdParam::PARAM_UINT) return RPC_TYPE;
+        if (v<param->getMin() || v>param->getMax()) return RPC_RANGE;
+        *(unsigned int *)param->getArg()=v;
+        return RPC_OK;
+    case VAL_STR:
+        if (p>=end || end-p-1<*p) return -1;
+        v=*p;
+        s=p+1;
+        p+=v+1;
+        if (!param) return RPC_NOTFOUND;
+        if (param->getType()!=CmdParam::PARAM_STR) return RPC_TYPE;
+        if (v>=param->getSize()) return RPC_SIZE;   // room for the 0, too
+        memcpy(param->getArg(),s,v);
+        ((char *)param->getArg())[v]='\0';
+        return RPC_OK;
+    }
+    return -1;
+}
+
+int MuxRPC::process(const unsigned char *req, int len, unsigned char *reply)
+{
+    const unsigned char *p=req+2, *end=req+len;
+    unsigned char *q=reply+2;
+    unsigned char *qend=reply+MAXREC-1-2;   // always room to say RPC_FULL or RPC_BAD
+    if (len<2) return 0;   // no ID to answer
+    reply[0]=req[0];
+    reply[1]=req[1];
+    while (p<end)
+    {
+        unsigned char *item=q;
+        int op=*p++, st=RPC_OK;
+        const CmdParam *param=NULL;
+        bool fit=true;
+        if (p>=end || op<OP_GET || op>OP_INFO)
+        {
+            st=RPC_BAD;
+            goto stop;
+        }
+        if (qend-q<2)
+        {
+            st=RPC_FULL;
+            goto stop;
+        }
+        if (*p<entries) param=&table[*p];
+        p++;
+        *q++=op;
+        *q++=RPC_OK;
+        switch (op)
+        {
+        case OP_GET:
+            if (!param) st=RPC_NOTFOUND;
+            else if (param->getType()==CmdParam::PARAM_NONE) st=RPC_TYPE;
+            else fit=putvalue(q,qend,*param);
+            break;
+        case OP_SET:
+            st=setvalue(p,end,param);
+            if (st<0)
+            {
+                q=item;
+                st=RPC_BAD;
+                goto stop;
+            }
+            break;
+        case OP_INFO:
+            if (!param) st=RPC_NOTFOUND;
+            else fit=putstr(q,qend,param->getName(),strlen(param->getName())) && putvalue(q,qend,*param);
+            break;
+        }
+        if (!fit)
+        {
+            q=item;
+            st=RPC_FULL;
+            goto stop;
+        }
+        if (st!=RPC_OK)
+        {
+            q=item+2;   // errors have no value
+            item[1]=st;
+        }
+        continue;
+    stop:
+        *q++=op;
+        *q++=st;
+        break;
+    }
+    return q-reply;
+}
+
+void MuxRPC::serve(void)
+{
+    unsigned char req[MAXREC], reply[MAXREC];
+    while (1)
+    {
+        int len, n;
+        if (port._read(req,1)!=1) continue;
+        len=req[0];
+        if (len && port._read(req+1,len)!=len) continue;
+        n=process(req+1,len,reply+1);
+        if (!n) continue;
+        reply[0]=n;
+        port.write(reply,n+1);
+        requests++;
+    }
+}
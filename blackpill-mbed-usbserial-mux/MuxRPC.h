@@ -0,0 +1,62 @@
+#ifndef __MUXRPC_H
+#define __MUXRPC_H
+
+#include "SerialMux.h"
+#include "CmdParam.h"
+#include <stdint.h>
+
+/* Binary get/set of the parameters in a CmdParam table
+
+The table entries that name a variable (PARAM_UINT or PARAM_STR, see CmdParam.h) are
+parameters, and their index in the table is the parameter number. Give the server a channel
+and a thread:
+
+    MuxRPC rpc(rpcConsole,commands);
+    rpc.serve();   // never returns
+
+Requests and replies are records like MUXLOG's: a length byte (bytes after itself), then
+a 16 bit request ID (little endian) that the reply echoes, then any number of items:
+
+    request item                       reply item
+    OP_GET idx                         OP_GET status value
+    OP_SET idx value                   OP_SET status
+    OP_INFO idx                        OP_INFO status name value
+
+A value is a tag and data: VAL_UINT then a varint (7 bits a byte, low first), VAL_STR then a
+length byte and the characters, or VAL_NONE (INFO on a command that is not a parameter).
+Items are done in order. If the reply runs out of room, the last item in it has status
+RPC_FULL and the rest are not done; a malformed item ends the reply with status RPC_BAD.
+INFO past the end of the table answers RPC_NOTFOUND, so a client can walk the table to learn
+the names. Other errors (RPC_TYPE, RPC_SIZE, and RPC_RANGE for a number outside the
+entry's range) only fail their own item.
+
+The client can send more requests without waiting for replies (they are answered in order),
+up to what fits in the channel's input buffer. See muxrpc in the Linux library.
+*/
+
+class MuxRPC
+{
+public:
+    enum { OP_GET=1, OP_SET, OP_INFO };
+    enum { RPC_OK=0, RPC_NOTFOUND, RPC_TYPE, RPC_SIZE, RPC_FULL, RPC_BAD, RPC_RANGE };
+    enum { VAL_NONE=0, VAL_UINT, VAL_STR };
+    enum { CHANNEL=250 };          // the usual channel (ttyparam's default)
+    static const int MAXREC=256;   // whole record including the length byte
+    MuxRPC(SerialMux &port, const CmdParam *table);
+    // answer requests forever
+    void serve(void);
+    // answer one request (no length byte); returns the reply length (at most MAXREC-1, 0 for none)
+    int process(const unsigned char *req, int len, unsigned char *reply);
+    unsigned long get_requests(void) { return requests; }
+protected:
+    SerialMux &port;
+    const CmdParam *table;
+    int entries;
+    unsigned long requests;
+    // put a parameter's value in the reply (false if it doesn't fit)
+    bool putvalue(unsigned char *&q, unsigned char *end, const CmdParam &p);
+    // take a value from a request and store it in the parameter (returns status, -1 if malformed)
+    int setvalue(const unsigned char *&p, const unsigned char *end, const CmdParam *param);
+};
+
+#endif
@@ -0,0 +1,77 @@
+#include "mbed.h"
+#include "MuxTelemetry.h"
+
+// Batched binary samples (see MuxTelemetry.h for the frame layout)
+
+MuxTelemetry::MuxTelemetry(SerialMux &port, int nvals, int batch, int maxage) : port(port)
+{
+    this->nvals=nvals<1?1:nvals>MAXVALS?MAXVALS:nvals;
+    this->batch=batch<1?1:batch>255?255:batch;
+    this->maxage=maxage*1000U;
+    len=0;
+    count=0;
+    t0=tlast=0;
+    frames=0;
+    dropped=0;
+}
+
+// varint into p, returns its length
+int MuxTelemetry::putvar(char *p, uint32_t v)
+{
+    int n=0;
+    while (v>0x7f)
+    {
+        p[n++]=(v&0x7f)|0x80;
+        v>>=7;
+    }
+    p[n++]=v;
+    return n;
+}
+
+void MuxTelemetry::sample(const int32_t *v, uint32_t us)
+{
+    char enc[5+MAXVALS*5];
+    int n=0;
+    if (count && us-t0>=maxage) flush();
+    if (!count)
+    {
+        // new frame: header and the values as they are
+        frame[1]=nvals;
+        t0=us;
+        for (int i=0;i<4;i++) frame[3+i]=us>>(8*i);
+        len=7;
+        for (int i=0;i<nvals;i++) n+=putvar(enc+n,((uint32_t)v[i]<<1)^(uint32_t)(v[i]>>31));
+    }
+    else
+    {
+        n=putvar(enc,us-tlast);
+        for (int i=0;i<nvals;i++)
+        {
+            int32_t d=(uint32_t)v[i]-(uint32_t)last[i];
+            n+=putvar(enc+n,((uint32_t)d<<1)^(uint32_t)(d>>31));
+        }
+        if (len+n>MAXFRAME)
+        {
+            flush();
+            sample(v,us);  // starts a new frame, which always fits
+            return;
+        }
+    }
+    memcpy(frame+len,enc,n);
+    len+=n;
+    count++;
+    tlast=us;
+    memcpy(last,v,nvals*sizeof(int32_t));
+    if (count==batch) flush();
+}
+
+void MuxTelemetry::flush(void)
+{
+    if (!count) return;
+    frame[0]=len-1;
+    frame[2]=count;
+    // a piece of a frame would throw ttymux off, so it goes whole or not at all
+    if (port.write_whole(frame,len)) frames++;
+    else dropped++;
+    count=0;
+}
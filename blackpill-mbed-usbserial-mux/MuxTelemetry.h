@@ -0,0 +1,61 @@
+#ifndef __MUXTELEMETRY_H
+#define __MUXTELEMETRY_H
+
+#include "SerialMux.h"
+#include <stdint.h>
+
+/* Binary telemetry frames
+
+    MuxTelemetry adc(telemetryConsole,2);   // 2 values in each sample
+    int32_t v[2]={a,b};
+    adc.sample(v);                          // time stamped with us_ticker_read()
+
+Samples are batched into frames and each frame goes out on the channel in one write, whole
+or not at all (see get_dropped):
+
+    len nvals count t0(4) values [dt values]...
+
+    len       bytes after itself (a frame is at most 256 bytes)
+    nvals     values in each sample (up to MAXVALS)
+    count     samples in the frame
+    t0        the first sample's time in microseconds, little endian
+    values    first sample: the values; after that each value minus the one before it
+    dt        microseconds since the sample before
+
+values are zigzag varints (7 bits a byte, low first, top bit set if more follow, and the
+sign in the low bit so small negative numbers are small too) and dt is a varint. A slowly
+changing signal sampled at a steady rate costs 2 or 3 bytes a sample.
+
+A frame goes out when the next sample won't fit, when it has batch samples, or when a sample
+comes in maxage ms after the frame's first one. Call flush to send what is there now.
+Only one thread (or ISR) should feed a MuxTelemetry. ttymux -T turns frames into CSV or
+binary records (see readme).
+*/
+
+class MuxTelemetry
+{
+public:
+    static const int MAXVALS=16;
+    static const int MAXFRAME=256;
+    MuxTelemetry(SerialMux &port, int nvals, int batch=255, int maxage=100);
+    // add a sample of nvals values
+    void sample(const int32_t *v) { sample(v,us_ticker_read()); }
+    void sample(const int32_t *v, uint32_t us);
+    // send the samples we have
+    void flush(void);
+    unsigned long get_frames(void) { return frames; }
+    // frames that didn't fit (a non-blocking channel without room for them; give it more than MAXFRAME bytes out)
+    unsigned long get_dropped(void) { return dropped; }
+protected:
+    SerialMux &port;
+    int nvals, batch;
+    uint32_t maxage;        // microseconds
+    char frame[MAXFRAME];
+    int len, count;
+    uint32_t t0, tlast;
+    int32_t last[MAXVALS];
+    unsigned long frames, dropped;
+    static int putvar(char *p, uint32_t v);
+};
+
+#endif
@@ -1,146 +1,565 @@
 #include "mbed.h"
 #include "SerialMux.h"
+#include <climits>
+#include <cerrno>
 
 // This implements the Williams mux serial protocol
 // FF [FF...] FE => actual FF character
 // FF [FF...] NN => Swtich to channel N (0-FC)
 // FF [FF...] FD => Ask other side to retransmit FF NN
+// FF [FF...] FC NN CC => Credit: other side can take CC more bytes on channel NN (credit mode)
 
-Stream *SerialMux::tty=NULL;   // our main tty
-Thread SerialMux::rthread(osPriorityNormal,OS_STACK_SIZE*3/2,NULL,"Mux Rcv");   // threads
-Thread SerialMux::wthread(osPriorityNormal,OS_STACK_SIZE*3/2,NULL,"Mux Xmit");
-SerialMux *SerialMux::head=NULL;  // linked list head
-short SerialMux::coutput=-1;  // current output and input in case we are asked (v2 protocol)
-short SerialMux::cinput=-1;
-bool SerialMux::sync=false;  // should we wait for a handshake (v2 protocol)
-Mutex SerialMux::ttymtx;     // mutex to protect writing to tty
+unsigned SerialMux::count=0;    // channels that exist (on any link)
+char *SerialMux::arena=NULL;     // optional fixed memory for buffers
+size_t SerialMux::arenasize=0;
+size_t SerialMux::arenaused=0;
 
-// constructor bsize<8 vttyid between 0 and 0xFD (but see note at top)
-// After construction if mask=0 something was wrong
-SerialMux::SerialMux(int vttyid, buffsize bsize) 
+MuxLink::MuxLink() : rthread(osPriorityNormal,OS_STACK_SIZE*3/2,NULL,"Mux Rcv"),   // threads
+    wthread(osPriorityNormal,OS_STACK_SIZE*3/2,NULL,"Mux Xmit")
 {
-    blocking=1;
+    init();
+    frame=NULL;   // start gets them
+    framemax=0;
+    rxbuf=NULL;
+    rxmax=0;
+}
+
+MuxLink::MuxLink(char *fbuf, unsigned fsize, char *rbuf, unsigned rsize) : rthread(osPriorityNormal,OS_STACK_SIZE*3/2,NULL,"Mux Rcv"),
+    wthread(osPriorityNormal,OS_STACK_SIZE*3/2,NULL,"Mux Xmit")
+{
+    init();
+    frame=fbuf;
+    framemax=framesize=fsize;
+    rxbuf=rbuf;
+    rxmax=rxchunk=rsize;
+}
+
+void MuxLink::init(void)
+{
+    tty=NULL;
+    head=NULL;
+    memset(chanslot,0,sizeof(chanslot));   // ID lookup table for readthread
+    memset(chanidx,0,sizeof(chanidx));
+    chanoverflow=false;
+    rxchunk=64;
+    txidle=false;
+    txlazy=false;
+    syncreq=false;      // protocol replies for writethread to send
+    muxsyncreq=false;
+    heard=false;
+    coutput=-1;   // current output and input in case we are asked (v2 protocol)
     cinput=-1;
-    coutput=-1;
-    next=head;
-    head=this;
+    sync=false;   // should we wait for a handshake (v2 protocol)
+    credits=false;   // flow control (v3 protocol)
+    framelen=0;
+    framesize=64;
+    txturn=0;   // writethread's turns
+    rxstate=0;
+    rxsynced=false;
+    rxcreditid=0;
+    rxcur=NULL;
+}
+
+// Made the first time it is used, so channels in other files can't get to it before it is constructed
+MuxLink &SerialMux::deflink()
+{
+    static MuxLink link;
+    return link;
+}
+
+// Use a fixed block of memory for buffers (call before creating channels)
+bool SerialMux::use_arena(char *mem, size_t size)
+{
+    if (count) return false;
+    arena=mem;
+    arenasize=size;
+    arenaused=0;
+    return true;
+}
+
+// Get a buffer from the arena if there is one, otherwise the heap
+char *SerialMux::alloc(unsigned size)
+{
+    char *p;
+    if (!arena) return new char[size];
+    if (arenaused+size>arenasize) return NULL;  // out of room
+    p=arena+arenaused;
+    arenaused+=size;
+    return p;
+}
+
+size_t MuxLink::footprint()
+{
+    size_t n=sizeof(MuxLink)+framemax+rxmax;
+    for (SerialMux *p=head;p;p=p->next) n+=sizeof(SerialMux)+p->imask+p->omask+2;
+    return n;
+}
+
+size_t SerialMux::footprint()
+{
+    return deflink().footprint()+arenasize-arenaused;
+}
+
+// constructor rxsize, txsize <=15 vttyid between 0 and 0xFD (but see note at top)
+// After construction if imask=0 something was wrong
+SerialMux::SerialMux(int vttyid, buffsize rxsize, buffsize txsize) 
+{
+    init(deflink(),vttyid,rxsize,txsize,NULL,NULL);
+}
+
+SerialMux::SerialMux(MuxLink &link, int vttyid, buffsize rxsize, buffsize txsize)
+{
+    init(link,vttyid,rxsize,txsize,NULL,NULL);
+}
+
+// buffers supplied by the caller (they must be 2^rxsize and 2^txsize bytes and outlive us)
+SerialMux::SerialMux(MuxLink &link, int vttyid, buffsize rxsize, buffsize txsize, char *ibuf, char *obuf)
+{
+    init(link,vttyid,rxsize,txsize,ibuf,obuf);
+}
+
+void SerialMux::init(MuxLink &link, int vttyid, buffsize rxsize, buffsize txsize, char *ibuf, char *obuf)
+{
+    blocking=1;
     id=vttyid;
     ihead=itail=ohead=otail=0;
-    if (bsize<=8&&bsize!=0) 
+    txcredit=0;
+    txflow=false;
+    oflushreq=false;
+    rxwaiting=txwaiting=false;
+    rxwake=1;
+    rxneed=1;
+    rxuntil=-1;
+    priority=0;
+    quantum=0;
+    lastturn=0;
+    mpsc=false;
+    opos=0;
+    mpscwaiters=0;
+    rxdelim=-1;
+    txwake=1;
+    txdelim=-1;
+    overruns=0;
+    this->link=&link;
+    link.add(this);
+    count++;
+    if (txsize==BUFFER_SAME) txsize=rxsize;
+    ibuffer=obuffer=NULL;
+    ownbuf=false;
+    imask=omask=0;   // we should throw an exception here but check imask=0 instead
+    rxowed=0;
+    if (rxsize<=15&&rxsize>=2&&txsize<=15&&txsize>=2) 
     {
-        unsigned short m=1<<bsize; // make sure this is a short
-        ibuffer=new char[m];
-        obuffer=new char[m];
-        mask=m-1;
+        unsigned m=1<<rxsize;
+        unsigned o=1<<txsize;
+        ownbuf=ibuf!=NULL;
+        ibuffer=ownbuf?ibuf:alloc(m);
+        obuffer=ownbuf?obuf:alloc(o);
+        if (ibuffer && obuffer)
+        {
+            imask=m-1;
+            omask=o-1;
+            rxowed=imask;   // in credit mode, the whole buffer is granted at start
+        }
     }
-    else 
-      mask=0 ;  // we should throw an exception here but check mask=0 instead;
 }
 
 // clean up 
 SerialMux::~SerialMux() 
     {
-        // if these are null it doesn't matter
-        SerialMux *i;
-        for (i=head;i;i=i->next)
+        link->remove(this);
+        count--;
+        if (!arena && !ownbuf)   // arena buffers are never given back
         {
-            if (i->next==this) i->next=next;  // remove me from chain
+            delete [] ibuffer;
+            delete [] obuffer;
         }
-        delete [] ibuffer;
-        delete [] obuffer;
     }
 
+// Put a new channel on our list (and in the lookup table if there is a free slot)
+void MuxLink::add(SerialMux *chan)
+{
+    uint8_t id=chan->id&0xff;
+    chan->next=head;
+    head=chan;
+    if (!chanidx[id])
+    {
+        int i;
+        for (i=0;i<MAXCHANS && chanslot[i];i++);
+        if (i<MAXCHANS)
+        {
+            chanslot[i]=chan;
+            chanidx[id]=i+1;
+        }
+        else chanoverflow=true;   // readthread will have to search for it
+    }
+}
+
+// Take a channel off our list
+void MuxLink::remove(SerialMux *chan)
+{
+    // if these are null it doesn't matter
+    SerialMux *i;
+    uint8_t id=chan->id&0xff;
+    for (i=head;i;i=i->next)
+    {
+        if (i->next==chan) i->next=chan->next;  // remove it from chain
+    }
+    if (head==chan) head=chan->next;
+    if (chanidx[id] && chanslot[chanidx[id]-1]==chan)
+    {
+        chanslot[chanidx[id]-1]=NULL;
+        chanidx[id]=0;
+    }
+}
+
+
+// Make frame and rxbuf as big as framesize and rxchunk (a StaticMuxLink already has them)
+bool MuxLink::getbuffers(void)
+{
+    if (!frame)
+    {
+        if (!(frame=SerialMux::alloc(framesize))) return false;
+        framemax=framesize;
+    }
+    if (!rxbuf)
+    {
+        if (!(rxbuf=SerialMux::alloc(rxchunk))) return false;
+        rxmax=rxchunk;
+    }
+    return true;
+}
 
 // Start our servers. Must have a base tty for this and only call this once!
-void SerialMux::start(Stream *basetty, bool syncflag)
+bool MuxLink::start(FileHandle *basetty, bool syncflag, bool creditflag)
 {
+    if (!getbuffers()) return false;
     sync=syncflag;
+    credits=creditflag;
     if (basetty) tty=basetty;
     // launch threads
-    if (rthread.get_state()!=rtos::Thread::Running) rthread.start(readthread);
-    if (wthread.get_state()!=rtos::Thread::Running) wthread.start(writethread);
+    if (rthread.get_state()!=rtos::Thread::Running) rthread.start(callback(this,&MuxLink::readthread));
+    if (wthread.get_state()!=rtos::Thread::Running) wthread.start(callback(this,&MuxLink::writethread));
+    return true;
+}
 
+// Start one thread for both directions if the port can do non-blocking reads (otherwise two)
+bool MuxLink::start_single(FileHandle *basetty, bool syncflag, bool creditflag)
+{
+    if (basetty) tty=basetty;
+    if (!getbuffers()) return false;
+    if (tty->set_blocking(false)!=0)
+    {
+        start(NULL,syncflag,creditflag);
+        return false;
+    }
+    sync=syncflag;
+    credits=creditflag;
+    tty->sigio(callback(this,&MuxLink::portready));
+    if (rthread.get_state()!=rtos::Thread::Running) rthread.start(callback(this,&MuxLink::iothread));
+    return true;
 }
 
 // Any characters waiting in our queue?
 bool SerialMux::readable(void)
 {
-    bool rv;
-    muxlock();
-    rv=ihead!=itail;
-    muxunlock();
-    return rv;
+    return ihead.load(std::memory_order_relaxed)!=itail.load(std::memory_order_acquire);
 }
 
-// Always writable (maybe that shouldn't be, but USBSerial does the same thing)
+// Room in the output buffer?
 bool SerialMux::writable(void)
 {
-   return 1;
+    return oincr(otail.load(std::memory_order_relaxed))!=ohead.load(std::memory_order_acquire);
+}
+
+// What is ready (FileHandle)
+short SerialMux::poll(short events) const
+{
+    short ready=0;
+    if (ihead.load(std::memory_order_relaxed)!=itail.load(std::memory_order_acquire)) ready|=POLLIN;
+    if (((otail.load(std::memory_order_relaxed)+1)&omask)!=ohead.load(std::memory_order_acquire)) ready|=POLLOUT;
+    return ready&events;
 }
 
 // Raw read, not the same as C lib read, but close
 // Using the stream lock seems to mess this up 
+// We own ihead; readthread only moves itail, so we copy out whatever is there at once
 ssize_t SerialMux::_read(void *buffer, size_t size)
 {
-    int rv;
     char *buf=(char *)buffer;
     size_t ct=0;
-    muxlock();
+    muxlock(true);   // one reader at a time
     while (size)
     {
-        if (itail==ihead)    // no characters? 
-           while (blocking && itail==ihead)   // if blocking wait
-           {
-              muxunlock();
-               ThisThread::yield();
-               muxlock();
-           }
-        if (ihead==itail && !blocking) break;  // or quit
-        *buf++=ibuffer[ihead];  // read
-        ihead=incr(ihead);
-        size--;
-        ct++;
-    }
-    muxunlock(); 
+        uint16_t h=ihead.load(std::memory_order_relaxed);
+        uint16_t t=itail.load(std::memory_order_acquire);
+        if (h==t)    // no characters? 
+        {
+            if (!blocking) break;  // quit
+            rxneed=size;
+            rxwaiting=true;       // or wait for readthread (check again so we can't miss it)
+            if (ihead.load()==itail.load()) evt.wait_any(RXREADY);
+            rxwaiting=false;
+            continue;
+        }
+        size_t n=(t>h?t:imask+1)-h;   // contiguous bytes available
+        if (n>size) n=size;
+        memcpy(buf,ibuffer+h,n);  // read
+        ihead.store((h+n)&imask,std::memory_order_release);
+        buf+=n;
+        size-=n;
+        ct+=n;
+        // that much room for the other side now (grant it before we block for more)
+        if ((rxowed+=n)>=(imask+1)/2 && link->credits) link->wakewriter();
+    }
+    muxunlock(true); 
     return ct;
 
 }
 
+// Look at the input without taking it: what is there is p1[0..n1) then p2[0..n2) (after the wrap)
+// Returns n1+n2. Only the thread that reads this channel should peek and consume
+size_t SerialMux::peek(const char **p1, size_t *n1, const char **p2, size_t *n2)
+{
+    uint16_t h=ihead.load(std::memory_order_relaxed);
+    uint16_t t=itail.load(std::memory_order_acquire);
+    *p1=ibuffer+h;
+    *p2=ibuffer;
+    if (t>=h)
+    {
+        *n1=t-h;
+        *n2=0;
+    }
+    else
+    {
+        *n1=imask+1-h;
+        *n2=t;
+    }
+    return *n1+*n2;
+}
+
+// Throw away n bytes you peeked at (and give the other side credit for them)
+void SerialMux::consume(size_t n)
+{
+    uint16_t h=ihead.load(std::memory_order_relaxed);
+    size_t k=available();
+    if (n>k) n=k;
+    ihead.store((h+n)&imask,std::memory_order_release);
+    if ((rxowed+=n)>=(imask+1)/2 && link->credits) link->wakewriter();
+}
+
+// Wait (if blocking) until delim is in the input or max bytes are
+// Returns how many bytes there are up to and including delim (or max), 0 if not there yet
+size_t SerialMux::scan(int delim, size_t max, bool wait)
+{
+    size_t done=0;   // bytes already searched
+    if (max>imask) max=imask;   // that's all the buffer can hold
+    muxlock(true);
+    while (1)
+    {
+        const char *p1,*p2;
+        size_t n1,n2,n=peek(&p1,&n1,&p2,&n2);
+        if (n>max) n=max;
+        // only search what's new since last time
+        while (done<n)
+        {
+            const char *p=done<n1?p1+done:p2+(done-n1);
+            size_t k=done<n1?n1-done:n2-(done-n1);
+            const char *q;
+            if (k>n-done) k=n-done;
+            if ((q=(const char *)memchr(p,delim,k)))
+            {
+                muxunlock(true);
+                return done+(q-p)+1;
+            }
+            done+=k;
+        }
+        if (n==max)
+        {
+            muxunlock(true);
+            return max;
+        }
+        if (!blocking || !wait) break;
+        rxneed=max;
+        rxuntil=delim;
+        rxwaiting=true;       // wait for readthread (check again so we can't miss it)
+        if (available()==n) evt.wait_any(RXREADY);
+        rxwaiting=false;
+        rxuntil=-1;
+    }
+    muxunlock(true);
+    return 0;
+}
+
+// Read up to and including delim, copying once
+// Returns 0 if the line isn't all there yet and we are not blocking
+ssize_t SerialMux::read_until(char *buf, size_t size, int delim)
+{
+    const char *p1,*p2;
+    size_t n1,n2,n;
+    muxlock(true);
+    n=scan(delim,size);
+    peek(&p1,&n1,&p2,&n2);
+    if (n1>n) n1=n;
+    memcpy(buf,p1,n1);
+    memcpy(buf+n1,p2,n-n1);
+    consume(n);
+    muxunlock(true);
+    return n;
+}
+
+// Like gets: read a line (with its newline) and terminate it. NULL if there isn't one yet (not blocking)
+char *SerialMux::readline(char *buf, size_t size)
+{
+    ssize_t n=read_until(buf,size-1,'\n');
+    if (n<=0) return NULL;
+    buf[n]='\0';
+    return buf;
+}
+
+// Contiguous free space in obuffer (wmtx held), waiting for some if we are blocking
+// We own otail; writethread only moves ohead
+char *SerialMux::txspan(size_t *len)
+{
+    while (1)
+    {
+        uint16_t t=otail.load(std::memory_order_relaxed);
+        uint16_t h=ohead.load(std::memory_order_acquire);
+        size_t n=(h>t?h:omask+1+h)-t-1;   // free space
+        if (n)
+        {
+            if (n>(size_t)(omask+1-t)) n=omask+1-t;   // contiguous part
+            *len=n;
+            return obuffer+t;
+        }
+        *len=0;
+        if (!blocking) return NULL;
+        link->wakewriter();
+        txwaiting=true;    // wait for writethread to make room
+        if (oincr(otail.load())==ohead.load()) evt.wait_any(TXSPACE);
+        txwaiting=false;
+    }
+}
+
+// n bytes at otail are ready to go (wmtx held)
+void SerialMux::txpublish(size_t n)
+{
+    uint16_t t=otail.load(std::memory_order_relaxed);
+    otail.store((t+n)&omask);   // (seq_cst: wakewriter must see it before it looks at txidle)
+    // wake writethread if that's enough to be worth it
+    if (n && (txwake==1 || (txdelim>=0 && memchr(obuffer+t,txdelim,n))
+              || ((otail.load()-ohead.load())&omask)>=txwake)) link->wakewriter();
+}
+
 // Raw write, not the same as C lib write, but close
 ssize_t SerialMux::_write(const void *buffer, size_t size)
 {
     size_t ct=0;
-    char *buf=(char *)buffer;
-   muxlock();
+    const char *buf=(const char *)buffer;
+    if (mpsc) return mpscwrite(buf,size);
+    muxlock(false);   // one writer at a time
 // if blocking=0 repeat until buffer is full or size is 0
-// if blocking=1 then repeat until size is 0 (but we need to unlock when full)
-   while ((blocking || incr(otail)!=ohead) && (size--)>0)
-   {
+// if blocking=1 then repeat until size is 0 (waiting when full)
+    while (size)
+    {
+        size_t n;
+        char *p=txspan(&n);
+        if (!p) break;
+        if (n>size) n=size;
+        memcpy(p,buf,n);  // write
+        txpublish(n);
+        buf+=n;
+        size-=n;
+        ct+=n;
+    }
+    muxunlock(false);
+    return ct;
+}
 
-       if (blocking && incr(otail)==ohead)  // sure, we don't really need to test blocking here
-       {
-            while (incr(otail)==ohead)  // wait
-            {
-               muxunlock();
-               ThisThread::yield();
-               muxlock();
-            }
+// All or nothing: a non-blocking channel checks for room first (we hold wmtx, so the room
+// can only grow), and a multi-producer write up to mpscmax is always one record
+bool SerialMux::write_whole(const void *buffer, size_t size)
+{
+    bool ok;
+    if (mpsc) return size<=mpscmax() && mpscwrite((const char *)buffer,size)==(ssize_t)size;
+    muxlock(false);
+    ok=blocking || size<=(size_t)(omask-((otail.load()-ohead.load())&omask));
+    if (ok) ok=_write(buffer,size)==(ssize_t)size;
+    muxunlock(false);
+    return ok;
+}
+
+size_t SerialMux::max_whole(void)
+{
+    if (mpsc) return mpscmax();
+    return blocking?0:omask;
+}
 
-       }
-      
-       obuffer[otail]=*buf++;  // write
-       otail=incr(otail);
-       ct++;
+// Zero copy output: get a span of the output buffer you can write into directly
+// Blocks for space (if blocking) and holds the channel until commit
+char *SerialMux::reserve(size_t *len)
+{
+    char *p;
+    if (mpsc) return NULL;
+    muxlock(false);
+    p=txspan(len);
+    if (!p) muxunlock(false);   // no room and not blocking: nothing to commit
+    return p;
+}
+
+// Send the first n bytes of the reserved span (can be 0) and let other writers go
+void SerialMux::commit(size_t n)
+{
+    txpublish(n);
+    muxunlock(false);
+}
+
+// Format straight into the output buffer if the line fits in the free space before the wrap
+// Otherwise format on the stack and write that (the C library still does the very long ones)
+int SerialMux::vprintf(const char *format, va_list args)
+{
+    size_t len;
+    int n;
+    va_list ap;
+    if (!mpsc)   // (multi-producer channels can't reserve, so they always use the stack)
+    {
+        char *p=reserve(&len);
+        if (!p) return -1;
+        va_copy(ap,args);
+        n=vsnprintf(p,len,format,ap);  // needs room for the trailing 0 too
+        va_end(ap);
+        if (n>=0 && (size_t)n<len)
+        {
+            commit(n);
+            return n;
+        }
+        commit(0);
+        if (n<0) return n;
+    }
+    char buf[PRINTF_BUFFER];
+    va_copy(ap,args);
+    n=vsnprintf(buf,sizeof(buf),format,ap);
+    va_end(ap);
+    if (n<0) return n;
+    if (n<PRINTF_BUFFER) return _write(buf,n);
+    return Stream::vprintf(format,args);
+}
 
-   }
-   muxunlock();
-   return ct;
+int SerialMux::printf(const char *format, ...)
+{
+    va_list args;
+    int n;
+    va_start(args,format);
+    n=vprintf(format,args);
+    va_end(args);
+    return n;
 }
 
 // Stream read and write call _putc/_getc and we revector them to our _read and _write
 int SerialMux::_putc(int c) 
 {
-   return (_write(&c,1)==1)?c:-1;
+    char ch=c;
+    return (_write(&ch,1)==1)?c:-1;
 }
 
 int SerialMux::_getc(void)
@@ -152,164 +571,496 @@ int SerialMux::_getc(void)
 
 
 // characters available?
-uint8_t SerialMux::available(void)
+uint16_t SerialMux::available(void)
 {
-    unsigned short t;
-    uint8_t rv;
-    muxlock();
-    t=itail;
-    if (t>ihead) t+=mask+1;  // adjust for backwards situtation
-    rv=t-ihead-1;
-    muxunlock();
-    return rv;
+    return (itail.load(std::memory_order_acquire)-ihead.load(std::memory_order_relaxed))&imask;
 }
 
 void SerialMux::iflush(void)
 {
-    muxlock();
-    ihead=itail;
-    muxunlock();
+    muxlock(true);
+    uint16_t h=ihead.load(std::memory_order_relaxed);
+    uint16_t t=itail.load(std::memory_order_acquire);
+    rxowed+=(t-h)&imask;
+    ihead.store(t,std::memory_order_release);
+    muxunlock(true);
 }
+
+// ohead belongs to writethread, so it does the flush for us
 void SerialMux::oflush(void)
 {
-    muxlock();
-    ohead=otail;
-    muxunlock();
+    oflushreq=true;
+    link->wakewriter();
 }
 
 
-// We need to write the code out here, but to do that we should own the tty
-void SerialMux::muxsync(void)
+// Ask writethread to send FF FD so the other side tells us its channel
+void MuxLink::muxsync(void)
+{
+    muxsyncreq=true;
+    wakewriter();
+}
+
+// Grant the other side the input space we freed up (writethread)
+void SerialMux::sendcredit(void)
 {
     char cc[4];
-    ttylock();
-    cc[2]=cc[0]='\xff';
-    cc[1]='\xfd';
-    cc[3]=coutput;   // answer with our current output channel
-    tty->write(cc,4);
-    ttyunlock();
+    unsigned short n=rxowed.exchange(0);
+    while (n)
+    {
+        uint8_t g=n>254?254:n;    // FF would look like an escape
+        cc[0]='\xff';
+        cc[1]='\xfc';
+        cc[2]=id;
+        cc[3]=g;
+        link->emit(cc,4);
+        n-=g;
+    }
+}
 
+// Set the most writethread sends to the port in one write (default 64, one full speed USB packet)
+void MuxLink::set_framesize(unsigned size)
+{
+    unsigned max=frame?framemax:(unsigned)MAXFRAME;   // a MuxLink's frame is made at start
+    if (size<4) size=4;    // room for the longest escape sequence
+    if (size>max) size=max;
+    framesize=size;
 }
 
-// Threads for dealing with the main tty
-// read from UART to buffers
-void SerialMux::readthread(void)
+// Add bytes to the frame (writethread), sending it first if they won't fit
+// n is never more than 4 so escape sequences don't get split
+void MuxLink::emit(const char *p, unsigned n)
 {
-    int state=0;
-    int synced=0;
-    SerialMux *current=NULL;
-    while (1)
+    if (framelen+n>framesize) flushframe();
+    memcpy(frame+framelen,p,n);
+    framelen+=n;
+}
+
+void MuxLink::flushframe(void)
+{
+    unsigned done=0;
+    while (done<framelen)
     {
-        if (!current) 
-            {
-                current=head;   // initialize to first vtty when it is available
-                cinput=current->id;
-            }
-        if (!current)
+        ssize_t n=tty->write(frame+done,framelen-done);
+        if (n>0) done+=n;
+        else if (n==-EAGAIN) txevt.wait_any(RXWORK,1);   // non-blocking port is full (start_single)
+        else break;   // port gone
+    }
+    framelen=0;
+}
+
+// Find a channel by ID (NULL if there isn't one)
+SerialMux *MuxLink::lookup(uint8_t id)
+{
+    SerialMux *p;
+    if (chanidx[id]) return chanslot[chanidx[id]-1];
+    if (!chanoverflow) return NULL;   // every channel is in the table
+    for (p=head;p;p=p->next) if (p->id==id) break;
+    return p;
+}
+
+// Copy a run of received bytes into our input buffer (readthread, we own itail)
+void SerialMux::store(const char *p, unsigned n)
+{
+    uint16_t t=itail.load(std::memory_order_relaxed);
+    uint16_t h=ihead.load(std::memory_order_acquire);
+    unsigned room=(h>t?h:imask+1+h)-t-1;
+    if (n>room)
+    {
+        overruns+=n-room;   // no room (can't happen if the other side obeys our credits)
+        n=room;
+    }
+    if (n==0) return;
+    unsigned k=imask+1-t;    // up to the end of the buffer
+    if (k>n) k=n;
+    memcpy(ibuffer+t,p,k);
+    memcpy(ibuffer,p+k,n-k);
+    itail.store((t+n)&imask);
+    if (rxwaiting || sigiocb) rxsignal(p,n);
+}
+
+// Wake a blocked reader if enough is waiting (or the delimiter just came in)
+// What the reader asked for (rxneed, rxuntil) only counts while it waits, so sigio goes by set_wake
+void SerialMux::rxsignal(const char *p, unsigned len)
+{
+    unsigned short n=(itail.load()-ihead.load())&imask;
+    if (n>=rxwake || n==imask || (rxdelim>=0 && memchr(p,rxdelim,len))
+        || (rxwaiting && (n>=rxneed || (rxuntil>=0 && memchr(p,rxuntil,len)))))
+    {
+        if (rxwaiting) evt.set(RXREADY);
+        if (sigiocb) sigiocb();
+    }
+}
+
+// Most bytes readthread asks the port for at once (the port has to return what it has, not wait for all of them)
+void MuxLink::set_rxchunk(unsigned size)
+{
+    unsigned max=rxbuf?rxmax:(unsigned)MAXFRAME;
+    if (size<1) size=1;
+    if (size>max) size=max;
+    rxchunk=size;
+}
+
+// Read what the port has and hand it to the channels (readthread)
+// Each read is split into runs of plain data that are copied into the channel in one go
+// Returns false if there was nothing to read
+bool MuxLink::rxservice(void)
+{
+    if (!rxcur)
         {
-            ThisThread::yield();    // no VTTYs yet, so just snooze
-            continue; // should sleep!
-        } 
-        char c;
-        if (tty->read(&c,1)!=1)   // get any waiting characters (could block)
+            rxcur=head;   // initialize to first vtty when it is available
+            if (rxcur) cinput=rxcur->id;
+        }
+    if (!rxcur) return false;   // no VTTYs yet
+    ssize_t len=tty->read(rxbuf,rxchunk);   // get any waiting characters (blocks unless start_single)
+    if (len<=0) return false;
+    if (!heard)
+    {
+        heard=true;    // now our credits will get there
+        wakewriter();
+    }
+    for (ssize_t i=0;i<len;)
+    {
+        if (rxstate==0)   // plain data up to the next FF
         {
-            ThisThread::yield();
-            continue;    // if nothing on the UART, loop
+            const char *ff=(const char *)memchr(rxbuf+i,0xff,len-i);
+            ssize_t end=ff?ff-rxbuf:len;
+            // ignore until we got one channel change at least (if sync set)
+            if (end>i && (!sync || rxsynced)) rxcur->store(rxbuf+i,end-i);
+            i=end;
+            if (i==len) break;
         }
+        char c=rxbuf[i++];
         if (c=='\xff')   // is this an escape code?
         {
-            state=1;  // any number of FFs in a row are OK
+            rxstate=1;  // any number of FFs in a row are OK
             continue;
         }
-        if (state!=0 && c=='\xfe')   // FF*FE is a real FF
+        if (rxstate==2)   // FF FC NN: remember the channel
         {
-            // real FF
-            c='\xff';
-            state=0;   // end escape code
+            rxcreditid=c;
+            rxstate=3;
+            continue;
         }
-        if (state!=0 && c=='\xfd')  // v2protocol, answer with our current output
+        if (rxstate==3)   // FF FC NN CC: we can send CC more bytes on NN
         {
-            char cc[2];
-            cc[0]='\xff';
-            cc[1]=coutput;
-            ttylock();
-            tty->write(cc,2);  // resend last output code
-            ttyunlock();
-            state=0;
+            SerialMux *p=lookup(rxcreditid);
+            if (p)
+            {
+                p->txcredit+=(uint8_t)c;
+                p->txflow=true;
+                wakewriter();
+            }
+            rxstate=0;
+            continue;
+        }
+        if (credits && c=='\xfc')  // credit message
+        {
+            rxstate=2;
             continue;
         }
-        if (state==1 )  // if state==1 here, we must change channels
+        rxstate=0;   // end escape code
+        if (c=='\xfe')   // FF*FE is a real FF
         {
-// find correct object on chain, set current, and 
-            for (current=head;current;current=current->next) if (current->id==c) break;
-            if (!current) current=head;  // oops! No object with that ID found
-            cinput=current->id;
-            state=0;  // end escape code
-            synced=1;
-            continue;  // no real characters received yet
+            if (!sync || rxsynced) rxcur->store("\xff",1);
+            continue;
         }
-        if (sync && !synced) continue;  // ignore until we got one channel change at least (if sync set)
-        // normal character
-        if (current->writable()) 
+        if (c=='\xfd')  // v2protocol, answer with our current output
         {
-            current->muxlock();
-            current->ibuffer[current->itail]=c;
-            current->itail=current->incr(current->itail);
-            current->muxunlock();
+            syncreq=true;   // writethread resends last output code
+            wakewriter();
+            continue;
         }
+        // otherwise we must change channels
+        rxcur=lookup(c);
+        if (!rxcur) rxcur=head;  // oops! No object with that ID found
+        cinput=rxcur->id;
+        rxsynced=true;
+    }
+    return true;
+}
 
+// One pass of the transmit side: protocol replies, credit and flushes, then one quantum
+// from the best channel. Returns false (after sending the frame) if there was nothing to send
+bool MuxLink::txservice(void)
+{
+    SerialMux *current;
+    if (syncreq.exchange(false) && coutput!=-1)   // other side asked for our channel
+    {
+        char cc[2];
+        cc[0]='\xff';
+        cc[1]=coutput;
+        emit(cc,2);
     }
+    if (muxsyncreq.exchange(false))   // we want the other side's channel
+    {
+        char cc[4];
+        cc[2]=cc[0]='\xff';
+        cc[1]='\xfd';
+        cc[3]=coutput;   // answer with our current output channel
+        emit(cc,coutput==-1?2:4);
+    }
+    for (current=head;current;current=current->next)  // for each vtty
+    {
+        if (credits && heard && current->rxowed>=(current->imask+1)/2)   // give back input space
+            current->sendcredit();
+        if (current->oflushreq.exchange(false))
+        {
+            if (current->mpsc) current->mpscdrop();
+            else current->ohead.store(current->otail.load());
+            if (current->txwaiting) current->evt.set(SerialMux::TXSPACE);
+            if (current->sigiocb) current->sigiocb();
+        }
+    }
+    // Pick the channel to send: highest priority first, taking turns with the same priority
+    // (the one that sent longest ago goes next, so a higher priority channel cutting in
+    // doesn't send the same lower one every time)
+    SerialMux *best=NULL;
+    for (current=head;current;current=current->next)
+        if ((!best || current->priority>best->priority ||
+             (current->priority==best->priority && (int32_t)(current->lastturn-best->lastturn)<0)) && current->txpending())
+            best=current;
+    if (best)
+    {
+        // send one quantum then look again, so a higher priority channel waits no more than that
+        best->txsend(best->quantum?best->quantum:framesize);
+        best->lastturn=++txturn;
+        return true;
+    }
+    flushframe();   // whatever is left goes out now
+    return false;
 }
 
+// Threads for dealing with the main tty
+// read from UART to buffers
+void MuxLink::readthread(void)
+{
+    while (1)
+    {
+        if (!head) ThisThread::sleep_for(10ms);    // no VTTYs yet, so just snooze
+        else if (!rxservice()) ThisThread::sleep_for(1ms);   // port gone or not blocking: don't spin
+    }
+}
 
 //write from buffers to UART
-void SerialMux::writethread(void)
+void MuxLink::writethread(void)
 {
-    int channel=-1;
-    char c;
-    SerialMux *current=NULL;
+    bool armed=false;
     coutput=-1;
     while (1)
     {
-        for (current=head;current;current=current->next)  // for each vtty
-        {
-            bool go=false;
-            current->muxlock();
-            if (current->ohead!=current->otail) go=true;    // something is there
-            if (!go)
-            {
-                current->muxunlock();    // nothing here, so try the next one
-                continue;
-            }
-            if (channel!=current->id)   // do we need to switch channels?
-            {
-                char cc[2];
-                cc[0]='\xff';
-                channel=cc[1]=current->id;
-                coutput=channel;
-                // send escape code
-                ttylock();
-                tty->write(cc,2);
-                ttyunlock();
-            }
+        txidle=armed;   // once set, anyone who gives us work wakes us up
+        if (txservice()) armed=false;
+        // Only sleep after a pass that found nothing with txidle already set,
+        // otherwise work queued during the pass could be missed
+        else if (!armed) armed=true;
+        else txevt.wait_any(TXWORK,txlazy?(uint32_t)SerialMux::TXFLUSH_MS:osWaitForever);    // nothing to send: sleep until there is
+    }
+}
 
-            while (current->ohead!=current->otail)   // send characters until buffer empty
-            {
-                c=current->obuffer[current->ohead];
-                current->ohead=current->incr(current->ohead);
-                char cc[2];
-                cc[0]=c;
-                cc[1]='\xFE';
-                // send escape code or normal character
-                ttylock();
-                tty->write(cc,(c=='\xff')?2:1);
-                ttyunlock();
-            }
-            current->muxunlock();
+// Both directions in one thread (see start_single). Reads don't block, and the port's
+// sigio wakes us the same way a channel with something to send does
+void MuxLink::iothread(void)
+{
+    bool armed=false;
+    coutput=-1;
+    while (1)
+    {
+        txidle=armed;
+        bool busy=rxservice();
+        if (txservice()) busy=true;
+        if (busy) armed=false;
+        else if (!armed) armed=true;
+        else txevt.wait_any(TXWORK|RXWORK,txlazy?(uint32_t)SerialMux::TXFLUSH_MS:head?osWaitForever:10);
+    }
+}
+
+// Bytes we could send now (pending and within our credit)
+int SerialMux::txpending(void)
+{
+    if (mpsc) return mpscpending();
+    int n=(otail.load()-ohead.load(std::memory_order_relaxed))&omask;
+    if (txflow && txcredit<n) n=txcredit;
+    return n>0?n:0;
+}
+
+// Encode up to max bytes into the frame (writethread)
+void SerialMux::txsend(int max)
+{
+    uint16_t h=ohead.load(std::memory_order_relaxed);
+    bool wasfull=((otail.load()+1)&omask)==h;   // tell sigio when it gets room
+    int n,limit=txpending();
+    if (limit>max) limit=max;
+    MuxLink *l=link;
+    if (l->coutput!=id)   // do we need to switch channels?
+    {
+        char cc[2];
+        cc[0]='\xff';
+        l->coutput=cc[1]=id;
+        // send escape code
+        l->emit(cc,2);
+    }
+    if (mpsc)
+    {
+        mpscsend(max);
+        return;
+    }
+    // encode characters into the frame until we hit the limit
+    for (n=0;n<limit;n++)
+    {
+        l->encode(obuffer[h]);
+        h=oincr(h);
+    }
+    if (txflow) txcredit-=n;
+    ohead.store(h);   // it's all in the frame now so the space is free
+    if (txwaiting) evt.set(TXSPACE);
+    if (wasfull && n && sigiocb) sigiocb();
+}
+
+// Multi-producer output (see set_mpsc)
+// The record header at pos (it's aligned, so this is one load or store)
+uint16_t SerialMux::recheader(uint16_t pos)
+{
+    return __atomic_load_n((uint16_t *)(obuffer+pos),__ATOMIC_ACQUIRE);
+}
+
+// Bytes a record takes in obuffer (skips cover the rest of the buffer and count their header)
+static inline unsigned recsize(uint16_t hdr)
+{
+    unsigned n=hdr&SerialMux::RECLEN;
+    return hdr&SerialMux::RECSKIP?n:2+((n+1)&~1u);
+}
+
+bool SerialMux::set_mpsc(void)
+{
+    if (!obuffer || ((uintptr_t)obuffer&1) || otail.load()!=ohead.load()) return false;
+    memset(obuffer,0,omask+1);   // headers read 0 until they are committed
+    ohead=otail=0;
+    opos=0;
+    mpsc=true;
+    return true;
+}
+
+// Claim room for an n byte record (any thread or ISR), skipping to the start of the
+// buffer if it won't fit before the end. Returns false if there isn't room
+bool SerialMux::mpscreserve(size_t n, uint16_t *pos)
+{
+    unsigned rec=2+((n+1)&~1u), skip;
+    uint16_t t=otail.load();
+    do
+    {
+        uint16_t h=ohead.load(std::memory_order_acquire);
+        skip=t+rec>omask+1u?omask+1-t:0;
+        if (skip+rec>(unsigned)(omask-((t-h)&omask))) return false;
+    } while (!otail.compare_exchange_weak(t,(t+skip+rec)&omask));
+    if (skip)   // writethread jumps over the end of the buffer
+    {
+        __atomic_store_n((uint16_t *)(obuffer+t),RECCOMMIT|RECSKIP|skip,__ATOMIC_RELEASE);
+        t=0;
+    }
+    *pos=t;
+    return true;
+}
+
+// Longest record: two of them always fit in the buffer
+size_t SerialMux::mpscmax(void)
+{
+    size_t most=(omask+1)/2-2;
+    return most>RECLEN?(size_t)RECLEN:most;
+}
+
+// Each piece of up to mpscmax bytes is one record, so it comes out in one piece
+// No locks, and in an ISR (or if not blocking) it never waits: it returns what fit
+ssize_t SerialMux::mpscwrite(const char *buf, size_t size)
+{
+    size_t ct=0, most=mpscmax();
+    bool wait=blocking && !core_util_is_isr_active();
+    while (ct<size)
+    {
+        size_t n=size-ct;
+        uint16_t pos;
+        if (n>most) n=most;
+        if (!mpscreserve(n,&pos))
+        {
+            if (!wait) break;
+            // Several producers can be waiting, so nobody clears TXSPACE as it wakes. Clear it
+            // before looking again instead: if writethread frees something after that we see
+            // it, and if another producer clears it first writethread sets it again as long
+            // as there is something left to send (the timeout is only a backstop)
+            bool got;
+            mpscwaiters++;
+            evt.clear(TXSPACE);
+            link->wakewriter();
+            if (!(got=mpscreserve(n,&pos))) evt.wait_any(TXSPACE,TXFLUSH_MS,false);
+            mpscwaiters--;
+            if (!got) continue;
         }
-        ThisThread::yield();
-  
+        memcpy(obuffer+pos+2,buf+ct,n);
+        __atomic_store_n((uint16_t *)(obuffer+pos),RECCOMMIT|n,__ATOMIC_RELEASE);   // writethread can have it
+        ct+=n;
+    }
+    if (ct) link->wakewriter();
+    return ct;
+}
+
+// Bytes we could send from the first record (writethread)
+int SerialMux::mpscpending(void)
+{
+    uint16_t h=ohead.load(std::memory_order_relaxed);
+    uint16_t hdr=recheader(h);
+    if ((hdr&(RECCOMMIT|RECSKIP))==(RECCOMMIT|RECSKIP))   // go back to the start
+    {
+        memset(obuffer+h,0,hdr&RECLEN);
+        ohead.store(0);
+        hdr=recheader(0);
     }
+    if (!(hdr&RECCOMMIT)) return 0;   // empty or still being written
+    int n=(hdr&RECLEN)-opos;
+    if (txflow && txcredit<n) n=txcredit;
+    return n>0?n:0;
 }
 
+// Encode up to max bytes of committed records, zeroing each one once it has all gone
+void SerialMux::mpscsend(int max)
+{
+    int n, sent=0;
+    bool freed=false;
+    while (sent<max && (n=mpscpending()))
+    {
+        uint16_t h=ohead.load(std::memory_order_relaxed);
+        uint16_t hdr=recheader(h);
+        const char *p=obuffer+h+2+opos;
+        if (n>max-sent) n=max-sent;
+        for (int i=0;i<n;i++) link->encode(p[i]);
+        if (txflow) txcredit-=n;
+        sent+=n;
+        opos+=n;
+        if (opos==(hdr&RECLEN))   // done with this record
+        {
+            memset(obuffer+h,0,recsize(hdr));
+            opos=0;
+            ohead.store((h+recsize(hdr))&omask);
+            freed=true;
+        }
+    }
+    // Waiting producers all wake at once, so let them wait for half the buffer unless this is
+    // all we can send for now
+    if (freed && (sent<max || ((otail.load()-ohead.load())&omask)<=(omask+1)/2))
+    {
+        if (mpscwaiters) evt.set(TXSPACE);
+        if (sigiocb) sigiocb();
+    }
+}
 
+// oflush: throw away the records that are complete
+void SerialMux::mpscdrop(void)
+{
+    uint16_t h=ohead.load(std::memory_order_relaxed), hdr;
+    while ((hdr=recheader(h))&RECCOMMIT)
+    {
+        memset(obuffer+h,0,recsize(hdr));
+        h=(h+recsize(hdr))&omask;
+        ohead.store(h);
+    }
+    opos=0;
+}
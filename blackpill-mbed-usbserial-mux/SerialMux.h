@@ -1,79 +1,338 @@
 #ifndef __SERIALMUX_H
 #define __SERIALMUX_H
 
+#include <atomic>
+
 // This implements the Williams mux serial protocol
 // FF [FF...] FE => actual FF character
 // FF [FF...] NN => Swtich to channel N (0-FD)
-// Note: plan to make FF FD a code to retransmit your current channel back to us
-// But not implemented yet
+// FF [FF...] FD => Ask other side to retransmit FF NN
+// FF [FF...] FC NN CC => Other side can take CC (1-FE) more bytes on channel NN (credit mode only)
+// In credit mode we grant the other side room in our input buffers and once it grants us credit
+// for a channel we never send more than that (see start)
+
+class SerialMux;
+
+// One multiplexed port: the base tty, the threads that serve it and the channels on it
+// Most programs only need the default link that SerialMux::start and the plain
+// constructors use. For more ports (say USB and two UARTs) make a MuxLink for each,
+// above its channels in the same file, and start each one:
+//   MuxLink uartlink;
+//   SerialMux gps(uartlink,1);
+//   uartlink.start(&uart);
+// A MuxLink gets its frame and read chunk buffers (from the arena or heap) when it starts, sized
+// to set_framesize and set_rxchunk. A StaticMuxLink keeps them in the object instead
+class MuxLink
+{
+    friend class SerialMux;
+public:
+    MuxLink();
+    // start threads. creditflag turns on flow control (channel FC is not available then)
+    // false (and nothing started) if there is no room for the buffers
+    bool start(FileHandle *basetty, bool syncflag=true, bool creditflag=false);
+    // Same, but one thread does both directions, which saves a thread stack. The port has to
+    // do non-blocking reads and call sigio when it has data (BufferedSerial does). If it can't
+    // be made non-blocking this starts the usual two threads and returns false (false too if start would)
+    bool start_single(FileHandle *basetty, bool syncflag=true, bool creditflag=false);
+    // Most bytes writethread hands the port in one write (4-512, default 64 for a full speed USB packet)
+    // Once the buffers exist it can't be more than they hold
+    void set_framesize(unsigned size);
+    // Most bytes readthread asks the port for in one read (1-512, default 64). The port's read
+    // must return what it has rather than wait for all of them (USBSerial does). If yours waits, use 1
+    void set_rxchunk(unsigned size);
+    // Ask the other side to resend its output select packet (handshake) V2 protocol
+    void muxsync(void);
+    // Find out the current input/output channels
+    short get_current_input() { return cinput; }
+    short get_current_output() { return coutput; }
+    // RAM used by this link and its channels (threads' stacks not included)
+    size_t footprint();
+protected:
+    MuxLink(char *fbuf, unsigned fsize, char *rbuf, unsigned rsize);   // StaticMuxLink's buffers
+    void init(void);         // constructors' common part
+    bool getbuffers(void);   // start: frame and rxbuf if we don't have them yet
+    FileHandle *tty;   // base tty for this link (USBSerial, BufferedSerial, ...)
+    void readthread(void);  // threads for reading and writing the tty
+    void writethread(void);
+    void iothread(void);    // or both in one (start_single; it runs on rthread)
+    Thread rthread;        // Thread objects for above
+    Thread wthread;
+    bool rxservice(void);  // a read's worth of input (the threads' loops call these)
+    bool txservice(void);  // a quantum of output
+    // readthread's parser state
+    int rxstate;   // 1 = escape, 2 = credit channel next, 3 = credit count next
+    bool rxsynced;
+    char rxcreditid;
+    SerialMux *rxcur;
+    SerialMux *head;  // linked list of our SerialMux objects
+    // readthread finds channels by ID through chanidx (slot+1, 0 if none)
+    enum { MAXCHANS=32 };
+    SerialMux *chanslot[MAXCHANS];
+    uint8_t chanidx[256];
+    bool chanoverflow;    // more than MAXCHANS channels, so some have to be searched for
+    SerialMux *lookup(uint8_t id);
+    void add(SerialMux *chan);      // channel constructor and destructor
+    void remove(SerialMux *chan);
+    unsigned rxchunk;
+    // writethread sleeps on txevt when it has nothing to send (iothread also waits for RXWORK)
+    EventFlags txevt;
+    enum { TXWORK=1, RXWORK=2 };
+    std::atomic<bool> txidle;
+    bool txlazy;    // some channel has txwake>1 so writethread must check now and then
+    void wakewriter() { if (txidle && !(txevt.get()&TXWORK)) txevt.set(TXWORK); }
+    void portready() { txevt.set(RXWORK); }   // the port's sigio (start_single)
+    // Only writethread writes to the tty; these ask it to send protocol replies for us
+    std::atomic<bool> syncreq;     // answer FF FD with our current output
+    std::atomic<bool> muxsyncreq;  // send FF FD (muxsync)
+    // Credits written before the other side is listening are lost, so we don't grant any
+    // until we have heard from it (ttymux -f grants its credits as soon as it starts)
+    std::atomic<bool> heard;
+    // remember current input/output
+    short cinput, coutput;
+    // sync option - true if you should pitch input until you see a handshake (v2)
+    bool sync;
+    // credit option - grant credits for our input buffers (v3)
+    bool credits;
+    // writethread encodes into a frame and sends it to the port in one write
+    enum { MAXFRAME=512 };
+    char *frame;
+    unsigned framelen, framesize, framemax;   // framemax is frame's size (0 before it has one)
+    void emit(const char *p, unsigned n);
+    void flushframe(void);
+    void encode(char c)   // add a data byte to the frame (escaped if it is FF)
+    {
+        if (c=='\xff')
+        {
+            if (framelen+2>framesize) flushframe();
+            frame[framelen++]=c;
+            frame[framelen++]='\xfe';
+        }
+        else
+        {
+            if (framelen==framesize) flushframe();
+            frame[framelen++]=c;
+        }
+    }
+    char *rxbuf;   // readthread's chunk
+    unsigned rxmax;
+    // writethread sends a quantum at a time, highest priority channel first
+    uint32_t txturn;   // quanta sent (channels with the same priority go in order of their last turn)
+};
 
 class SerialMux : public Stream
 {
+    friend class MuxLink;
 private:
-    unsigned short incr(unsigned short v) { return (v+1)&mask; }  // increment circular buffer pointer
-    unsigned short mask;    // circular buffer mask
+    uint16_t iincr(uint16_t v) { return (v+1)&imask; }  // increment circular buffer pointers
+    uint16_t oincr(uint16_t v) { return (v+1)&omask; }
+    uint16_t imask, omask;    // circular buffer masks (size-1)
+    static char *alloc(unsigned size);   // buffer from the arena (or heap)
+    bool ownbuf;                  // buffers belong to a StaticSerialMux, not the arena or heap
+    static char *arena;           // see use_arena
+    static size_t arenasize, arenaused;
+    static unsigned count;        // channels that exist (on any link)
 protected:
-    static Stream *tty;       // base tty for all instances
-    static void readthread(void);  // threads for reading and writing the UART
-    static void writethread(void);
-    static Thread rthread;        // Thread objects for above
-    static Thread wthread;
-    static SerialMux *head;  // linked list of all SerialMux objects
-    SerialMux *next;         // next item on list
+    MuxLink *link;           // the port we are on
+    SerialMux *next;         // next item on link's list
     bool blocking;           // true if blocking (default)
-    uint8_t ihead, itail, ohead, otail;  // buffers for input/output
+    // buffers for input/output are single producer/single consumer rings
+    // readthread fills ibuffer (itail) and the reader empties it (ihead)
+    // writers fill obuffer (otail) and writethread empties it (ohead)
+    // Each index is only stored by its owner, so the rings need no lock
+    std::atomic<uint16_t> ihead, itail, ohead, otail;
+    std::atomic<int> txcredit;   // bytes the other side can take from us (if txflow)
+    std::atomic<bool> txflow;    // true once the other side sends us credit
+    std::atomic<unsigned short> rxowed;   // bytes read out of ibuffer that we have not granted back yet
+    std::atomic<bool> oflushreq;  // writethread should throw away obuffer
+    // Blocked readers and writers wait on evt instead of spinning
+    // readthread sets RXREADY once rxwake bytes (or rxdelim) arrive, writethread sets TXSPACE
+    EventFlags evt;
+    enum { RXREADY=1, TXSPACE=2 };
+    std::atomic<bool> rxwaiting, txwaiting;   // only signal evt if somebody is waiting
+    unsigned short rxwake;   // wake a blocked reader when this many bytes are waiting
+    size_t rxneed;           // (or when it has all it asked for)
+    int rxuntil;             // (or scan's delimiter arrives)
+    int rxdelim;             // or when this character arrives (-1 for none)
+    unsigned short txwake;   // same for waking writethread when we write
+    int txdelim;
+    Callback<void()> sigiocb;   // see sigio
+    void rxsignal(const char *p, unsigned n);   // readthread: wake the reader (or sigio) if it is time
+    void store(const char *p, unsigned n);   // readthread: add received bytes to ibuffer
+    char *txspan(size_t *len);     // free space in obuffer (wmtx held)
+    void txpublish(size_t n);      // hand it to writethread
+    unsigned long overruns;  // bytes lost because ibuffer was full
     char *ibuffer;
     char *obuffer;
     short id;                 // our channel ID or tag (00-FD)
-    Mutex mtx;   // Stream's mutex behaves oddly so we use our own
-    static Mutex ttymtx;   // lock up the real port
-    // These functions lock before manipulating ihead/ohead/itail/otail per object
-    void muxlock() {  mtx.lock(); }
-    void muxunlock() {  mtx.unlock(); }
-    // These functions lock the real serial port for the object
-    static void ttylock(void) {   ttymtx.lock(); }
-    static void ttyunlock(void) { ttymtx.unlock(); }
-    // remember current input/output
-    static short cinput, coutput;
-    // sync option - true if you should pitch input until you see a handshake (v2)
-    static bool sync;
+    Mutex rmtx, wmtx;   // Stream's mutex behaves oddly so we use our own
+    // These functions keep more than one thread from reading (or writing) this object at once
+    // They are taken once per call, not per byte, and the mux threads never take them
+    void muxlock(bool rd) {  (rd?rmtx:wmtx).lock(); }
+    void muxunlock(bool rd) {  (rd?rmtx:wmtx).unlock(); }
+    void sendcredit();   // send what we owe (writethread)
+    // writethread sends a quantum at a time, highest priority channel first
+    uint8_t priority;
+    unsigned short quantum;   // 0 means a frame's worth
+    uint32_t lastturn;        // link's txturn when we last sent
+    int txpending(void);
+    void txsend(int max);
+    // Multi-producer mode (set_mpsc): obuffer holds records, each a 16 bit header (length and
+    // flags) and the data, padded to an even size. Producers claim space by moving otail with
+    // a compare and swap and set COMMIT in the header once the data is in. writethread sends
+    // records in order, stops at one that isn't committed yet and zeroes what it has sent,
+    // so a header reads 0 until its producer commits it
+    bool mpsc;
+    unsigned short opos;   // writethread: bytes of the record at ohead already sent
+    std::atomic<short> mpscwaiters;   // producers waiting for room
+    uint16_t recheader(uint16_t pos);
+    bool mpscreserve(size_t n, uint16_t *pos);
+    size_t mpscmax(void);
+    ssize_t mpscwrite(const char *buf, size_t size);
+    int mpscpending(void);
+    void mpscsend(int max);
+    void mpscdrop(void);
 public:
 // buffer size constants
-    enum buffsize { BUFFER_SIZE4=2, BUFFER_SIZE8=3, BUFFER_SIZE16=4, BUFFER_SIZE32=5, BUFFER_SIZE64=6,
-       BUFFER_SIZE128=7, BUFFER_SIZE256=8 };
-    static void start(Stream *basetty, bool syncflag=true);   // start threads
-    // constructor & destructor
-    SerialMux(int vttyid,buffsize bsize=BUFFER_SIZE16);   // 4=2^4 = 16
+    enum buffsize { BUFFER_SAME=0, BUFFER_SIZE4=2, BUFFER_SIZE8=3, BUFFER_SIZE16=4, BUFFER_SIZE32=5, BUFFER_SIZE64=6,
+       BUFFER_SIZE128=7, BUFFER_SIZE256=8, BUFFER_SIZE512=9, BUFFER_SIZE1K=10, BUFFER_SIZE2K=11,
+       BUFFER_SIZE4K=12, BUFFER_SIZE8K=13, BUFFER_SIZE16K=14, BUFFER_SIZE32K=15 };
+    // The default link (used by the constructors without one and the static functions below)
+    static MuxLink &deflink();
+    // start the default link's threads (see MuxLink)
+    static bool start(FileHandle *basetty, bool syncflag=true, bool creditflag=false) { return deflink().start(basetty,syncflag,creditflag); }
+    static bool start_single(FileHandle *basetty, bool syncflag=true, bool creditflag=false) { return deflink().start_single(basetty,syncflag,creditflag); }
+    static void set_framesize(unsigned size) { deflink().set_framesize(size); }
+    static void set_rxchunk(unsigned size) { deflink().set_rxchunk(size); }
+    // Buffers come from the heap unless you call use_arena first. Then every channel
+    // constructed afterwards carves its buffers out of mem and nothing is allocated later
+    // Channels are usually globals, so define the arena and call this from a static
+    // initializer above them in the same file. Returns false if it is too late (channels exist)
+    static bool use_arena(char *mem, size_t size);
+    static size_t arena_used() { return arenaused; }
+    // RAM used by the default link and its channels plus any unused arena (threads' stacks not included)
+    static size_t footprint();
+    // constructor & destructor (txsize defaults to the same as rxsize)
+    SerialMux(int vttyid,buffsize rxsize=BUFFER_SIZE16,buffsize txsize=BUFFER_SAME);   // 4=2^4 = 16
+    SerialMux(MuxLink &link,int vttyid,buffsize rxsize=BUFFER_SIZE16,buffsize txsize=BUFFER_SAME);
+    // Same, but with buffers you supply (see StaticSerialMux)
+    SerialMux(MuxLink &link,int vttyid,buffsize rxsize,buffsize txsize,char *ibuf,char *obuf);
     ~SerialMux();
 // warning: these enable and disable I/O for everyone -- probably shouldn't use them
-    int enable_input(bool e) { return tty?tty->enable_input(e):-1; }
-    int enable_output(bool e) { return tty?tty->enable_output(e):-1; }
+    int enable_input(bool e) { return link->tty?link->tty->enable_input(e):-1; }
+    int enable_output(bool e) { return link->tty?link->tty->enable_output(e):-1; }
     // blocking behavior is the default
     int set_blocking(bool blocking) { this->blocking=blocking; return 0; }
     bool is_blocking() { return blocking; }
     // returning 1 from isatty breaks the C library I/O!
    // int isatty() { return 1; }
     bool readable();   // characters available?
-    uint8_t available();  // how many characters available?
-    bool writable();    // writable? Always return 1 (like USBSerial does)
+    uint16_t available();  // how many characters available?
+    unsigned long get_overruns() { return overruns; }  // input bytes lost to a full buffer
+    bool writable();    // room in the output buffer?
+    // FileHandle readiness: poll reports POLLIN/POLLOUT and func is called from the mux threads
+    // when data comes in (by set_wake's count and delimiter, or a full buffer) or when a full
+    // output buffer gets room. So one thread can serve several channels by waiting on an
+    // EventFlags that func sets. Keep func short, and install it before traffic starts
+    short poll(short events) const override;
+    void sigio(Callback<void()> func) override { sigiocb=func; }
+    // A blocked read wakes up when count bytes are waiting (default 1), it has all it asked for,
+    // the delimiter arrives, or the buffer is full. Bigger counts mean fewer wakeups (but a
+    // blocked read waits for them, so pick a delimiter if the data comes in short bursts)
+    void set_wake(unsigned short count, int delim=-1) { rxwake=count?count:1; rxdelim=delim; }
+    // Same idea for output: writethread is woken when count bytes are buffered or the delimiter
+    // is written (say '\n'). Anything less goes out within TXFLUSH_MS
+    void set_txwake(unsigned short count, int delim=-1) { txwake=count?count:1; txdelim=delim; if (txwake>1) link->txlazy=true; }
+    enum { TXFLUSH_MS=20 };
     // stream needs these to do all the other things it does
     int _putc(int c);  
     int _getc(void);
 
+    // Zero copy input for the thread that reads this channel: peek shows what is waiting as
+    // up to two spans (the second is after the wrap) and consume takes n bytes of it
+    size_t peek(const char **p1, size_t *n1, const char **p2, size_t *n2);
+    void consume(size_t n);
+    // Wait (if blocking) for delim or max bytes; returns the byte count through delim (0 if not yet)
+    // wait=false never waits, even on a blocking channel (say, in an event handler)
+    size_t scan(int delim, size_t max, bool wait=true);
+    // Read through delim (or size bytes) in one copy; readline is the same for '\n' and adds a 0
+    ssize_t read_until(char *buf, size_t size, int delim);
+    char *readline(char *buf, size_t size);
+
    // internal read and write (probably should use the normal versions if you can)
     ssize_t _read(void *buffer, size_t size);
     ssize_t _write(const void *buffer, size_t size);
+    ssize_t write(const void *buffer, size_t size) override { return _write(buffer,size); }   // (Stream's goes a byte at a time)
+    // All of buffer in one piece, or nothing (false) if it won't fit now and we can't wait or
+    // if it is bigger than one set_mpsc record (see max_whole). For records like MUXLOG's
+    bool write_whole(const void *buffer, size_t size);
+    // Biggest write_whole that can ever work (0 for no limit: blocking and not set_mpsc)
+    size_t max_whole(void);
+    // Higher priority channels always go first (0 is the default). writethread sends a channel
+    // up to quantum bytes (default one frame) and then picks again, so a command channel
+    // set above a busy debug channel waits for at most that. Careful: a busy high priority
+    // channel can starve the others
+    void set_priority(uint8_t level, unsigned short quantum=0) { priority=level; this->quantum=quantum; }
+    // Multi-producer mode: any number of threads and interrupt handlers can write this channel
+    // without a lock and each write (up to half the output buffer less 2 bytes) comes out in one
+    // piece. Writes never wait in an ISR. Call before anything is written to the channel;
+    // returns false if it can't (no buffer or it isn't 2-byte aligned). Costs 2-3 bytes of
+    // buffer per write, so give the channel room; reserve/commit don't work in this mode
+    bool set_mpsc(void);
+    enum { RECCOMMIT=0x8000, RECSKIP=0x4000, RECLEN=0x3fff };   // record header bits
+    // Zero copy output: reserve returns where you can write up to *len bytes (they don't
+    // wrap) or NULL if there is no room and we are not blocking. Always follow a successful
+    // reserve with commit(number of bytes you wrote); nobody else can write this channel in between
+    char *reserve(size_t *len);
+    void commit(size_t n);
+    // printf that formats right into the output buffer when it can (Stream's goes a character at a time)
+    int printf(const char *format, ...);
+    int vprintf(const char *format, va_list args);
+    enum { PRINTF_BUFFER=128 };   // longest line formatted on the stack when it won't fit in one piece
 
-// Find out the current input/output channels
-    static short get_current_input() { return cinput; }
-    static short get_current_output() { return coutput; }
+// Find out the current input/output channels (default link)
+    static short get_current_input() { return deflink().cinput; }
+    static short get_current_output() { return deflink().coutput; }
     // flush things
     void iflush();
     void oflush();
     void flush() { oflush(); iflush(); }
     // Ask the other side to resend its output select packet (handshake) V2 protocol
-    static void muxsync(void); 
+    static void muxsync(void) { deflink().muxsync(); }
+private:
+    void init(MuxLink &link, int vttyid, buffsize rxsize, buffsize txsize, char *ibuf, char *obuf);   // constructors' common part
+};
+
+// A channel whose ID and sizes are fixed at build time, with its buffers inside the object
+// (so no heap or arena, and a bad ID or size is a compile error instead of imask==0):
+//   StaticSerialMux<1,SerialMux::BUFFER_SIZE16> analogConsole;
+//   StaticSerialMux<10,SerialMux::BUFFER_SIZE64,SerialMux::BUFFER_SIZE256> cmdConsole;
+template <int ID, SerialMux::buffsize RX, SerialMux::buffsize TX=SerialMux::BUFFER_SAME>
+class StaticSerialMux : public SerialMux
+{
+    static constexpr buffsize TXS=TX==BUFFER_SAME?RX:TX;
+    static_assert(ID>=0 && ID<=0xFD,"channel ID must be 00-FD");
+    static_assert(RX>=BUFFER_SIZE4 && RX<=BUFFER_SIZE32K && TXS>=BUFFER_SIZE4 && TXS<=BUFFER_SIZE32K,"buffer size must be 4 bytes to 32K");
+    char ibuf[1<<RX];
+    char obuf[1<<TXS];
+public:
+    StaticSerialMux() : SerialMux(deflink(),ID,RX,TXS,ibuf,obuf) {}
+    StaticSerialMux(MuxLink &link) : SerialMux(link,ID,RX,TXS,ibuf,obuf) {}
+};
 
+// A link whose frame and read chunk sizes are fixed at build time, with its buffers inside
+// the object (so it never allocates, and start can't fail for want of memory):
+//   StaticMuxLink<> uartlink;          // 64 byte frames and reads
+//   StaticMuxLink<512,16> usblink;     // big frames out, small reads in
+// set_framesize and set_rxchunk can still make them smaller
+template <unsigned FRAME=64, unsigned RXCHUNK=64>
+class StaticMuxLink : public MuxLink
+{
+    static_assert(FRAME>=4 && FRAME<=MAXFRAME,"frame size must be 4-512");
+    static_assert(RXCHUNK>=1 && RXCHUNK<=MAXFRAME,"read chunk must be 1-512");
+    char fbuf[FRAME];
+    char rbuf[RXCHUNK];
+public:
+    StaticMuxLink() : MuxLink(fbuf,FRAME,rbuf,RXCHUNK) {}
 };
 
 #endif
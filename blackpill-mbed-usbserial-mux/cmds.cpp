@@ -1,12 +1,11 @@
 #include "cmds.h"
 #include "CmdParam.h"
+#include "SerialMux.h"
+#include "MuxRPC.h"
 
 // This file has commands for the command window
 
-Stream *cmdtty;  // the command window
-// generic functions to set uint and string parameters
-static void set(unsigned int n, void *arg, const char *p); // forward refs
-static void setstr(unsigned int n, void *arg, const char *p); 
+static void mem(unsigned int n, void *arg, CmdLine &cl); // forward ref
 
 // sleep rates in ms and the string tag for the digital console
 unsigned int blinkrate=500;
@@ -17,65 +16,74 @@ extern char cmdstr[];
 
 
 // command table. See CmdParam.h/cpp for format
-CmdParam commands[] = {
-		       { 1, "blink", "Set blink rate in milliseconds", set, &blinkrate },
-               { 2, "arate", "Set analog rate in milliseconds", set, &arate },
-               { 3, "drate", "Set digtial rate in milliseconds", set, &drate },
-               { 4, "note", "Set note field on digital output", setstr, &cmdstr },
-		       { 6, "help", "This message", CmdParam::help, commands},
+// The rates and the note are plain variables, so the parser checks and sets them itself
+constexpr CmdParam commands[] = {
+		       { 1, "blink", "Set blink rate in milliseconds", NULL, &blinkrate, CmdParam::PARAM_UINT, 1, 60000 },
+               { 2, "arate", "Set analog rate in milliseconds", NULL, &arate, CmdParam::PARAM_UINT, 1, 60000 },
+               { 3, "drate", "Set digtial rate in milliseconds", NULL, &drate, CmdParam::PARAM_UINT, 1, 60000 },
+               { 4, "note", "Set note field on digital output", NULL, &cmdstr, CmdParam::PARAM_STR, CMDSTR_SIZE },
+               { 5, "mem", "Show RAM used by the serial mux", mem, NULL },
+		       { 6, "help", "This message", CmdParam::help, (void *)commands},
 
 		       { 0, "", "", NULL, NULL }
 };
+constexpr CmdHash<CMDCOUNT(commands)> cmdhash(commands);
+static_assert(cmdhash.ok,"can't hash the command table (same name twice?)");
 
 
-// just a dumb function to print ok
-static void ok()
+// report the mux memory footprint
+static void mem(unsigned int n, void *arg, CmdLine &cl)
 {
-    cmdtty->puts("OK\r\n");
+  char msg[64];
+  snprintf(msg,sizeof(msg),"SerialMux: %u bytes (arena %u used)\r\n",(unsigned)SerialMux::footprint(),(unsigned)SerialMux::arena_used());
+  cl.print(msg);
 }
 
-
-static void set(unsigned int n, void *arg, const char *p)
+// Run one command line (CmdConsole calls this from its queue)
+void cmdprocess(CmdLine &cl, const char *line, size_t len)
 {
-  bool valid;
-  unsigned int *v=(unsigned int *)arg;
-  unsigned int tkn=CmdParam::getuint(&valid);
-  if (valid) *v=tkn;
-  ok();
+    CmdParam::process(cmdhash,cl,line,len);
 }
 
-
-static void setstr(unsigned int n, void *arg, const char *p)
+// The RPC thread calls this which never returns
+void rpcloop(SerialMux *s)
 {
-  bool valid;
-  char *v=(char *)arg;
-  std::string tkn=CmdParam::gettoken(&valid);
-  if (valid)
-  {
-      strcpy(v,tkn.c_str());  // up to you not to overflow!
-  }
-  ok();
+    MuxRPC rpc(*s,commands);
+    rpc.serve();
 }
+
 // Simple main
 // we need to wait for USB connection so we don't bog up the stdout system
 // so we need to bring in the USBSerial from main :( )
 #include "USBSerial.h"
 extern USBSerial usbSerial;
 
-// The thread calls this which never returns
-void cmdloop(Stream *s)
+// A thread can call this instead of using a CmdConsole. It never returns
+// Commands are parsed right out of the channel's input buffer unless the line wraps around its end
+// Nothing here is shared, so more than one console can run this on its own thread
+void cmdloop(SerialMux *s)
   {
    char cmdline[257];
-   cmdtty=s;
+   CmdLine cl(s);   // answers go back to the same channel
    while (!usbSerial.connected()) ThisThread::sleep_for(250ms);
    while (1)
      {
+       const char *p1, *p2;
+       size_t n1, n2, n;
          // you will need your terminal set for echo and CR=>CRLF. Also, don't expect backspace, etc. in this mode
        s->putc('?');
        s->putc(' ');
-       s->gets(cmdline,sizeof(cmdline));    // presumably you won't overflow this buffer
-       CmdParam::process(commands,cmdline);   // do it!
+       n=s->scan('\n',sizeof(cmdline)-1);   // wait for a line (a long one comes in pieces)
+       s->peek(&p1,&n1,&p2,&n2);
+       if (n<=n1)
+         {
+           cmdprocess(cl,p1,n);   // do it!
+           s->consume(n);
+         }
+       else
+         {
+           n=s->read_until(cmdline,n,'\n');
+           cmdprocess(cl,cmdline,n);
+         }
      }
   }
-
-
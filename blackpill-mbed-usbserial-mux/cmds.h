@@ -2,15 +2,19 @@
 #define __CMD_H
 #include "mbed.h"
 #include "USBSerial.h"
+#include "SerialMux.h"
+#include "CmdParam.h"
 // definitions between main.cpp and cmds.cpp
 
 
 extern unsigned int blinkrate;  // led blink rate
 extern unsigned int arate;      // analog sample rate
 extern unsigned int drate;      // digital sample rate
-extern char cmdstr[];           // text note on digital window
-extern void cmdloop(Stream *s);  // the worker function for command processing
-extern Stream *cmdtty;          // command console stream
+#define CMDSTR_SIZE 32
+extern char cmdstr[CMDSTR_SIZE];  // text note on digital window
+extern void cmdloop(SerialMux *s);  // a thread that runs a command console
+extern void cmdprocess(CmdLine &cl, const char *line, size_t len);   // run one command line (for CmdConsole)
+extern void rpcloop(SerialMux *s);  // binary get/set of the same parameters (MuxRPC)
 
 
 
@@ -0,0 +1,28 @@
+#ifndef __HOST_USBSERIAL_H
+#define __HOST_USBSERIAL_H
+
+/* Host stand-in for Mbed's USBSerial
+   The "USB port" is a pseudoterminal. Its name is printed on stderr at startup
+   so you can point ttymux at it (or set MUX_TTY to use an existing tty instead).
+*/
+
+#include "mbed.h"
+
+class USBSerial : public Stream
+{
+public:
+    USBSerial(bool connect_blocking=true);
+    void connect() {}
+    bool connected() { return fd>=0; }
+    const char *name() { return ttyname; }
+    // read returns what is there (at least one byte) like the real one
+    ssize_t read(void *buffer, size_t size);
+    ssize_t write(const void *buffer, size_t size);
+protected:
+    int _putc(int c);
+    int _getc();
+    int fd;
+    char ttyname[64];
+};
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef __HOST_MBED_H
+#define __HOST_MBED_H
+
+/* Host (Linux) stand-in for the parts of Mbed OS the mux code uses
+   Threads and mutexes are std::thread/std::mutex, streams are plain objects
+   and the board I/O (DigitalIn/Out, AnalogIn) is simulated.
+
+   This is only for building and benchmarking the device code on a PC.
+   See readme.md (Host Build) for how to compile.
+*/
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstdarg>
+#include <cstring>
+#include <climits>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <sys/types.h>
+#include <poll.h>
+
+using namespace std::chrono_literals;
+
+// pins and modes used by the demo
+enum PinName { LED1, USER_BUTTON, PB_1, NC };
+enum PinMode { PullNone, PullUp, PullDown };
+
+// RTOS priorities and default stack
+enum osPriority { osPriorityIdle, osPriorityLow, osPriorityBelowNormal, osPriorityNormal,
+                  osPriorityAboveNormal, osPriorityHigh, osPriorityRealtime };
+typedef int osStatus;
+#define osOK 0
+#define osWaitForever 0xFFFFFFFFU
+#define osFlagsError 0x80000000U
+#define OS_STACK_SIZE 4096
+
+namespace mbed
+{
+    template <typename F> using Callback=std::function<F>;
+    template <typename T> Callback<void()> callback(T *obj, void (T::*method)()) { return [obj,method]() { (obj->*method)(); }; }
+
+    // Base for anything you can read and write
+    class FileHandle
+    {
+    public:
+        virtual ~FileHandle() {}
+        virtual ssize_t read(void *buffer, size_t size) = 0;
+        virtual ssize_t write(const void *buffer, size_t size) = 0;
+        virtual int close() { return 0; }
+        virtual int sync() { return 0; }
+        virtual int isatty() { return 0; }
+        virtual int set_blocking(bool blocking) { return blocking?0:-1; }
+        virtual bool is_blocking() const { return true; }
+        virtual int enable_input(bool enabled) { return -1; }
+        virtual int enable_output(bool enabled) { return -1; }
+        virtual short poll(short events) const { return POLLIN|POLLOUT; }   // POLLxxx from <poll.h> like Mbed's
+        virtual void sigio(Callback<void()> func) {}
+    };
+
+    FileHandle *mbed_override_console(int fd);
+
+    // Stream: everything funnels through _putc/_getc like Mbed's version
+    class Stream : public FileHandle
+    {
+    public:
+        Stream(const char *name=NULL) : _file(NULL) {}
+        virtual ~Stream();
+        int putc(int c) { return _putc(c); }
+        int puts(const char *s);
+        int getc() { return _getc(); }
+        char *gets(char *s, int size);
+        int printf(const char *format, ...);
+        int vprintf(const char *format, va_list args);
+        operator std::FILE *();
+        virtual ssize_t write(const void *buffer, size_t length);
+        virtual ssize_t read(void *buffer, size_t length);
+    protected:
+        virtual int _putc(int c) = 0;
+        virtual int _getc() = 0;
+        std::FILE *_file;
+    };
+
+    class DigitalOut
+    {
+        int value;
+    public:
+        DigitalOut(PinName pin, int v=0) : value(v) {}
+        void write(int v) { value=v; }
+        int read() { return value; }
+        DigitalOut &operator=(int v) { value=v; return *this; }
+        operator int() { return value; }
+    };
+
+    class DigitalIn
+    {
+    public:
+        DigitalIn(PinName pin) {}
+        void mode(PinMode pull) {}
+        int read() { return 1; }   // button not pressed (pulled up)
+        operator int() { return read(); }
+    };
+
+    class AnalogIn
+    {
+    public:
+        AnalogIn(PinName pin) {}
+        float read();              // slow sine wave 0.0-1.0
+        unsigned short read_u16() { return read()*65535.0f; }
+        operator float() { return read(); }
+    };
+}
+
+namespace rtos
+{
+    // Recursive like the Mbed one
+    class Mutex
+    {
+        std::recursive_mutex m;
+    public:
+        Mutex(const char *name=NULL) {}
+        void lock() { m.lock(); }
+        bool trylock() { return m.try_lock(); }
+        void unlock() { m.unlock(); }
+    };
+
+    // Sticky flag bits threads can wait on (wait_any returns the flags it saw)
+    class EventFlags
+    {
+        std::mutex m;
+        std::condition_variable cv;
+        uint32_t flags;
+    public:
+        EventFlags(const char *name=NULL) : flags(0) {}
+        uint32_t set(uint32_t f);
+        uint32_t clear(uint32_t f=0x7FFFFFFF);
+        uint32_t get() const { return flags; }
+        uint32_t wait_any(uint32_t f=0, uint32_t millisec=osWaitForever, bool clear=true);
+    };
+
+    class Thread
+    {
+    public:
+        enum State { Inactive, Ready, Running, WaitingDelay, Deleted };
+        Thread(osPriority priority=osPriorityNormal, uint32_t stack_size=OS_STACK_SIZE,
+               unsigned char *stack_mem=NULL, const char *name=NULL)
+            : state(Inactive), stacksize(stack_size), tname(name) {}
+        ~Thread();
+        osStatus start(std::function<void()> task);
+        osStatus join();
+        State get_state() const { return state; }
+        uint32_t stack_size() const { return stacksize; }
+        const char *get_name() const { return tname; }
+        // host only: CPU time this thread has used in ns (for benchmarks)
+        uint64_t cpu_time_ns();
+    private:
+        std::thread t;
+        State state;
+        uint32_t stacksize;
+        const char *tname;
+    };
+
+    namespace ThisThread
+    {
+        inline void yield() { std::this_thread::yield(); }
+        inline void sleep_for(std::chrono::milliseconds ms) { std::this_thread::sleep_for(ms); }
+    }
+}
+
+// Calls posted from any thread, run by whoever dispatches the queue. Mbed's has a fixed
+// block of memory for events; this one holds size/EVENTS_EVENT_SIZE calls, so call fails
+// (returns 0) when it is full just like on the board
+#define EVENTS_EVENT_SIZE 32
+#define EVENTS_QUEUE_SIZE (32*EVENTS_EVENT_SIZE)
+namespace events
+{
+    class EventQueue
+    {
+        std::mutex m;
+        std::condition_variable cv;
+        std::deque<mbed::Callback<void()>> q;
+        size_t most;
+        bool stop;
+        int nextid;
+    public:
+        EventQueue(unsigned size=EVENTS_QUEUE_SIZE, unsigned char *buffer=NULL) : most(size/EVENTS_EVENT_SIZE), stop(false), nextid(0) {}
+        int call(mbed::Callback<void()> f);
+        template <typename T> int call(T *obj, void (T::*method)()) { return call(mbed::callback(obj,method)); }
+        void dispatch_forever();
+        void break_dispatch();
+    };
+}
+
+// no interrupts on the host
+inline bool core_util_is_isr_active() { return false; }
+
+// free running microsecond counter (wraps like the board's)
+inline uint32_t us_ticker_read() { return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+using namespace mbed;
+using namespace rtos;
+using namespace events;
+
+#endif
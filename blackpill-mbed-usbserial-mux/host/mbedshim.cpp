@@ -0,0 +1,287 @@
+// Host implementation of the Mbed stand-ins in mbed.h and USBSerial.h
+
+#include "mbed.h"
+#include "USBSerial.h"
+#include <cmath>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <errno.h>
+
+namespace mbed
+{
+
+Stream::~Stream()
+{
+    if (_file) fclose(_file);
+}
+
+int Stream::puts(const char *s)
+{
+    while (*s) if (_putc(*s++)<0) return -1;
+    return 0;
+}
+
+// like fgets: stop after a newline or when the buffer is full
+char *Stream::gets(char *s, int size)
+{
+    int i=0;
+    while (i<size-1)
+    {
+        int c=_getc();
+        if (c<0) break;
+        s[i++]=c;
+        if (c=='\n') break;
+    }
+    if (i==0) return NULL;
+    s[i]='\0';
+    return s;
+}
+
+// Mbed formats through the C library which ends up in _putc for each character
+int Stream::vprintf(const char *format, va_list args)
+{
+    char buf[256];
+    int n=vsnprintf(buf,sizeof(buf),format,args);
+    if (n>=(int)sizeof(buf)) n=sizeof(buf)-1;
+    for (int i=0;i<n;i++) _putc(buf[i]);
+    return n;
+}
+
+int Stream::printf(const char *format, ...)
+{
+    va_list args;
+    va_start(args,format);
+    int n=vprintf(format,args);
+    va_end(args);
+    return n;
+}
+
+ssize_t Stream::write(const void *buffer, size_t length)
+{
+    const char *p=(const char *)buffer;
+    size_t i;
+    for (i=0;i<length;i++) if (_putc(p[i])<0) break;
+    return i;
+}
+
+ssize_t Stream::read(void *buffer, size_t length)
+{
+    char *p=(char *)buffer;
+    size_t i;
+    for (i=0;i<length;i++)
+    {
+        int c=_getc();
+        if (c<0) break;
+        p[i]=c;
+    }
+    return i;
+}
+
+// C library view of the stream (so clearerr etc. work)
+static ssize_t cookiewrite(void *cookie, const char *buf, size_t size)
+{
+    return ((Stream *)cookie)->write(buf,size);
+}
+
+static ssize_t cookieread(void *cookie, char *buf, size_t size)
+{
+    return ((Stream *)cookie)->read(buf,size);
+}
+
+Stream::operator std::FILE *()
+{
+    if (!_file)
+    {
+        cookie_io_functions_t io={cookieread,cookiewrite,NULL,NULL};
+        _file=fopencookie(this,"r+",io);
+        if (_file) setvbuf(_file,NULL,_IONBF,0);
+    }
+    return _file;
+}
+
+float AnalogIn::read()
+{
+    double t=std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    return 0.5+0.5*sin(t);
+}
+
+}
+
+namespace rtos
+{
+
+uint32_t EventFlags::set(uint32_t f)
+{
+    std::lock_guard<std::mutex> lk(m);
+    flags|=f;
+    cv.notify_all();
+    return flags;
+}
+
+uint32_t EventFlags::clear(uint32_t f)
+{
+    std::lock_guard<std::mutex> lk(m);
+    uint32_t old=flags;
+    flags&=~f;
+    return old;
+}
+
+uint32_t EventFlags::wait_any(uint32_t f, uint32_t millisec, bool clr)
+{
+    std::unique_lock<std::mutex> lk(m);
+    auto ready=[this,f]{ return (flags&f)!=0; };
+    if (millisec==osWaitForever) cv.wait(lk,ready);
+    else if (!cv.wait_for(lk,std::chrono::milliseconds(millisec),ready)) return osFlagsError|2;  // timeout
+    uint32_t got=flags;
+    if (clr) flags&=~f;
+    return got;
+}
+
+Thread::~Thread()
+{
+    if (t.joinable()) t.detach();
+}
+
+osStatus Thread::start(std::function<void()> task)
+{
+    if (state!=Inactive) return -1;
+    state=Running;
+    t=std::thread([this,task]() { task(); state=Deleted; });
+    if (tname) pthread_setname_np(t.native_handle(),tname);
+    return osOK;
+}
+
+osStatus Thread::join()
+{
+    if (t.joinable()) t.join();
+    return osOK;
+}
+
+uint64_t Thread::cpu_time_ns()
+{
+    clockid_t cid;
+    struct timespec ts;
+    if (state!=Running || pthread_getcpuclockid(t.native_handle(),&cid) || clock_gettime(cid,&ts)) return 0;
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+}
+
+namespace events
+{
+
+int EventQueue::call(mbed::Callback<void()> f)
+{
+    std::lock_guard<std::mutex> lk(m);
+    if (q.size()>=most) return 0;
+    q.push_back(f);
+    cv.notify_one();
+    if (++nextid<=0) nextid=1;
+    return nextid;
+}
+
+void EventQueue::dispatch_forever()
+{
+    std::unique_lock<std::mutex> lk(m);
+    stop=false;
+    while (!stop)
+    {
+        if (q.empty())
+        {
+            cv.wait(lk);
+            continue;
+        }
+        mbed::Callback<void()> f=q.front();
+        q.pop_front();
+        lk.unlock();
+        f();
+        lk.lock();
+    }
+}
+
+void EventQueue::break_dispatch()
+{
+    std::lock_guard<std::mutex> lk(m);
+    stop=true;
+    cv.notify_all();
+}
+
+}
+
+// The USB serial port is a pty (or MUX_TTY)
+USBSerial::USBSerial(bool connect_blocking)
+{
+    const char *dev=getenv("MUX_TTY");
+    struct termios info;
+    if (dev)
+    {
+        fd=open(dev,O_RDWR|O_NOCTTY);
+        snprintf(ttyname,sizeof(ttyname),"%s",dev);
+    }
+    else
+    {
+        fd=posix_openpt(O_RDWR|O_NOCTTY);
+        if (fd>=0)
+        {
+            grantpt(fd);
+            unlockpt(fd);
+            snprintf(ttyname,sizeof(ttyname),"%s",ptsname(fd));
+        }
+    }
+    if (fd<0)
+    {
+        perror("USBSerial");
+        return;
+    }
+    tcgetattr(fd,&info);
+    cfmakeraw(&info);
+    tcsetattr(fd,TCSANOW,&info);
+    fprintf(stderr,"USBSerial: %s\n",ttyname);
+}
+
+ssize_t USBSerial::read(void *buffer, size_t size)
+{
+    while (1)
+    {
+        ssize_t n=::read(fd,buffer,size);
+        if (n>0) return n;
+        if (n<0 && errno!=EAGAIN && errno!=EINTR && errno!=EIO) return -1;
+        // EIO means nobody has the other end open yet
+        if (n<0 && errno==EIO) usleep(100000);
+        else
+        {
+            struct pollfd pfd={fd,POLLIN,0};
+            ::poll(&pfd,1,-1);
+        }
+    }
+}
+
+ssize_t USBSerial::write(const void *buffer, size_t size)
+{
+    const char *p=(const char *)buffer;
+    size_t done=0;
+    while (done<size)
+    {
+        ssize_t n=::write(fd,p+done,size-done);
+        if (n<0 && errno!=EINTR && errno!=EAGAIN) return done?(ssize_t)done:-1;
+        if (n>0) done+=n;
+    }
+    return done;
+}
+
+int USBSerial::_putc(int c)
+{
+    char ch=c;
+    return write(&ch,1)==1?c:-1;
+}
+
+int USBSerial::_getc()
+{
+    unsigned char ch;
+    return read(&ch,1)==1?ch:-1;
+}
@@ -0,0 +1,607 @@
+/* SerialMux benchmark for the host build
+
+Runs the real SerialMux code against an in-memory "serial port" and reports
+throughput and the CPU cost per byte of the application side (_write/_read),
+the mux threads (writethread/readthread) and printf.
+
+The channels are the same as the demo (1, 2, 100 with 16 byte buffers and 10 with 64).
+
+Usage: muxbench [megabytes] [single]
+single runs the mux with one thread (start_single); its time shows up as readthread's
+*/
+
+#include "mbed.h"
+#include "SerialMux.h"
+#include "MuxLog.h"
+#include "MuxTelemetry.h"
+#include "CmdConsole.h"
+#include <atomic>
+#include <condition_variable>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <time.h>
+#include <unistd.h>
+
+// In-memory port: counts what the mux sends and feeds it canned input
+// The input side obeys the mux's credit grants like ttymux -f, so nothing is lost
+class MemTTY : public FileHandle   // a plain FileHandle, like BufferedSerial
+{
+public:
+    std::atomic<uint64_t> payload{0};   // data bytes received (escapes decoded)
+    std::atomic<uint64_t> raw{0};       // bytes written including escapes
+    std::atomic<uint64_t> writes{0};    // calls to write
+    std::atomic<uint64_t> chanbytes[256]={};   // payload per channel
+    int capture=-1;           // keep this channel's payload in captured
+    std::string captured;
+    int outchan=-1;           // channel the mux is sending on
+    uint64_t rate=0;          // if set, writes take as long as they would on a link this fast (bytes/s)
+    int wstate=0;             // 1 = after FF, 2 = after FF FC, 3 = after FF FC NN
+    unsigned char creditid=0;
+    long credit[256]={0};     // what the mux will take on each channel
+    int inchan=-1;            // channel the input is on
+    bool inesc=false;         // last input byte was FF
+    std::mutex m;
+    std::condition_variable cv;
+    const char *in=NULL;      // input to hand to readthread
+    size_t inlen=0, inpos=0;
+    size_t chunk=64;          // most we return from one read (one USB packet)
+    bool blocking=true;
+    Callback<void()> sigiocb;
+
+    ssize_t write(const void *buffer, size_t size)
+    {
+        const unsigned char *p=(const unsigned char *)buffer;
+        uint64_t n=0;
+        if (rate) std::this_thread::sleep_for(std::chrono::nanoseconds(size*1000000000ULL/rate));   // data "arrives" at the end
+        for (size_t i=0;i<size;i++)
+        {
+            if (wstate==2) { creditid=p[i]; wstate=3; continue; }
+            if (wstate==3)
+            {
+                {
+                    std::lock_guard<std::mutex> lk(m);
+                    credit[creditid]+=p[i];
+                    cv.notify_all();
+                }
+                if (sigiocb) sigiocb();   // might have input we can send now
+                wstate=0;
+                continue;
+            }
+            if (p[i]==0xFF) { wstate=1; continue; }
+            if (wstate==1)
+            {
+                wstate=p[i]==0xFC?2:0;
+                if (p[i]==0xFE)
+                {
+                    n++;
+                    chanbytes[outchan&0xff]++;
+                    if (outchan==capture) captured+=(char)0xFF;
+                }
+                else if (p[i]<0xFC) outchan=p[i];
+                continue;
+            }
+            n++;
+            chanbytes[outchan&0xff]++;
+            if (outchan==capture) captured+=(char)p[i];
+        }
+        writes++;
+        raw+=size;
+        payload+=n;
+        return size;
+    }
+    // take up to max bytes of input (m held), stopping when the channel is out of credit
+    size_t take(char *buffer, size_t max)
+    {
+        size_t n=0;
+        while (inpos<inlen && n<max)
+        {
+            unsigned char b=in[inpos];
+            if (inesc)
+            {
+                inesc=false;
+                if (b!=0xFE) inchan=b;    // channel switch
+                else if (credit[inchan]>0) credit[inchan]--;
+                else { inesc=true; break; }
+            }
+            else if (b==0xFF) inesc=true;
+            else if (inchan>=0 && credit[inchan]>0) credit[inchan]--;
+            else break;
+            buffer[n++]=b;
+            inpos++;
+        }
+        return n;
+    }
+    ssize_t read(void *buffer, size_t size)
+    {
+        std::unique_lock<std::mutex> lk(m);
+        size_t n;
+        if (!blocking) return (n=take((char *)buffer,std::min(size,chunk)))>0?(ssize_t)n:-EAGAIN;
+        cv.wait(lk,[&]{ return (n=take((char *)buffer,std::min(size,chunk)))>0; });   // block like USBSerial
+        return n;
+    }
+    void feed(const char *data, size_t len)
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            in=data;
+            inlen=len;
+            inpos=0;
+            cv.notify_all();
+        }
+        if (sigiocb) sigiocb();
+    }
+    int set_blocking(bool b) { blocking=b; return 0; }
+    void sigio(Callback<void()> func) { sigiocb=func; }
+};
+
+// gives us the mux threads so we can read their CPU time
+class BenchLink : public MuxLink
+{
+public:
+    Thread &rt() { return rthread; }
+    Thread &wt() { return wthread.get_state()==Thread::Running?wthread:rthread; }   // start_single: one thread does it all
+};
+
+static MemTTY port;
+static BenchLink muxlink;
+StaticSerialMux<1,SerialMux::BUFFER_SIZE16> analogConsole(muxlink);
+StaticSerialMux<2,SerialMux::BUFFER_SIZE16> digitalConsole(muxlink);
+StaticSerialMux<100,SerialMux::BUFFER_SIZE16> debugConsole(muxlink);
+StaticSerialMux<10,SerialMux::BUFFER_SIZE64> cmdConsole(muxlink);
+SerialMux bulkConsole(muxlink,20,SerialMux::BUFFER_SIZE4K);   // not in the demo: lets the receive side keep up
+// 4 writers with a mutex or set_mpsc, with a small buffer (writers wait for room), the demo's 1K and a big one
+StaticSerialMux<30,SerialMux::BUFFER_SIZE16,SerialMux::BUFFER_SIZE256> lockedLog(muxlink);
+StaticSerialMux<31,SerialMux::BUFFER_SIZE16,SerialMux::BUFFER_SIZE256> mpscLog(muxlink);
+StaticSerialMux<32,SerialMux::BUFFER_SIZE16,SerialMux::BUFFER_SIZE1K> lockedMidLog(muxlink);
+StaticSerialMux<33,SerialMux::BUFFER_SIZE16,SerialMux::BUFFER_SIZE1K> mpscMidLog(muxlink);
+StaticSerialMux<34,SerialMux::BUFFER_SIZE16,SerialMux::BUFFER_SIZE8K> lockedBigLog(muxlink);
+StaticSerialMux<35,SerialMux::BUFFER_SIZE16,SerialMux::BUFFER_SIZE8K> mpscBigLog(muxlink);
+StaticSerialMux<40,SerialMux::BUFFER_SIZE16,SerialMux::BUFFER_SIZE256> telemetryConsole(muxlink);
+
+// what the 16 command consoles run: "add n" adds n to the total and answers OK
+static unsigned long addtotal;
+static void add(unsigned int id, void *arg, CmdLine &cl)
+{
+    *(unsigned long *)arg+=cl.getuint();
+    cl.print("OK\r\n");
+}
+constexpr CmdParam benchcmds[]={ { 1, "add", "Add to the total", add, &addtotal }, { 0, "", "", NULL, NULL } };
+constexpr CmdHash<CMDCOUNT(benchcmds)> benchhash(benchcmds);
+static void benchprocess(CmdLine &cl, const char *line, size_t len)
+{
+    CmdParam::process(benchhash,cl,line,len);
+}
+
+// parser checks: a CmdLine that keeps what it prints, and a table with a number of each kind
+class CheckLine : public CmdLine
+{
+public:
+    std::string got;
+    void print(const char *msg) override { got+=msg; }
+};
+static unsigned int checkrate;
+static void checkint(unsigned int id, void *arg, CmdLine &cl)
+{
+    bool valid;
+    int v=cl.getint(&valid);
+    char msg[32];
+    snprintf(msg,sizeof(msg),valid?"%d\r\n":"bad\r\n",v);
+    cl.print(msg);
+}
+constexpr CmdParam checkcmds[]={ { 1, "rate", "", NULL, &checkrate, CmdParam::PARAM_UINT },
+                                 { 2, "int", "", checkint, NULL },
+                                 { 3, "r", "", checkint, NULL },
+                                 { 0, "", "", NULL, NULL } };
+static const struct { const char *line; size_t len; const char *want; } checks[]={
+    { "rate 4294967295", 15, "OK\r\n" },
+    { "rate 4294967296", 15, "Need a number\r\n" },
+    { "rate 4294967297", 15, "Need a number\r\n" },
+    { "rate 18446744073709551617", 25, "Need a number\r\n" },
+    { "rate 0xffffffff", 15, "OK\r\n" },
+    { "rate 0x100000000", 16, "Need a number\r\n" },
+    { "int 2147483647", 14, "2147483647\r\n" },
+    { "int 2147483648", 14, "bad\r\n" },
+    { "int -2147483648", 15, "-2147483648\r\n" },
+    { "int -2147483649", 15, "bad\r\n" },
+    { "int 4294967297", 14, "bad\r\n" },
+    { "int -0", 6, "0\r\n" },
+    { "ra\0te 5", 8, "Not found: ra\r\n" },   // a 0 ends a token
+    { "rate\0 7", 8, "OK\r\n" },
+    { "r\0nt 1", 7, "bad\r\n" },
+    { "in", 2, "Not found: in\r\n" },
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+static uint64_t thread_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+static void report(const char *what, uint64_t bytes, uint64_t wall, uint64_t app, const char *appname, uint64_t mux, const char *muxname)
+{
+    printf("%-28s %8.2f MB/s  %-8s %7.1f ns/byte  %-12s %7.1f ns/byte\n",what,bytes*1000.0/wall,
+           appname,(double)app/bytes,muxname,(double)mux/bytes);
+}
+
+// wait until the port has seen total payload bytes
+static void drain(uint64_t total)
+{
+    while (port.payload<total) ThisThread::yield();
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t mb=argc>1?atoi(argv[1]):4;
+    uint64_t total=mb*1024*1024;
+    uint64_t t0,a0,w0,base;
+    char block[64];
+    memset(block,'x',sizeof(block));
+    setvbuf(stdout,NULL,_IOLBF,0);
+    // flow control on so the receive tests don't overrun
+    if (argc>2 && !strcmp(argv[2],"single")) muxlink.start_single(&port,false,true);
+    else muxlink.start(&port,false,true);
+    printf("%-28s %8u bytes\n","SerialMux RAM",(unsigned)muxlink.footprint());
+    {
+        unsigned right=0, n=sizeof(checks)/sizeof(checks[0]);
+        for (unsigned i=0;i<n;i++)
+        {
+            CheckLine cl;
+            CmdParam::process(checkcmds,cl,checks[i].line,checks[i].len);
+            if (cl.got==checks[i].want) right++;
+            else printf("%-28s %s gave %s","",checks[i].line,cl.got.c_str());
+        }
+        printf("%-28s %8u of %u right\n","command parser checks",right,n);
+    }
+
+    // nothing to do: the mux threads should be asleep
+    {
+        uint64_t r0=muxlink.rt().cpu_time_ns();
+        w0=muxlink.wt().cpu_time_ns();
+        ThisThread::sleep_for(500ms);
+        printf("%-28s %8.2f ms CPU in 500 ms (readthread %.2f, writethread %.2f)\n","idle",
+               (muxlink.rt().cpu_time_ns()-r0+(&muxlink.wt()!=&muxlink.rt()?muxlink.wt().cpu_time_ns()-w0:0))/1e6,
+               (muxlink.rt().cpu_time_ns()-r0)/1e6,(muxlink.wt().cpu_time_ns()-w0)/1e6);
+    }
+
+    // one channel, 64 byte writes
+    base=port.payload;
+    t0=now_ns(); a0=thread_ns(); w0=muxlink.wt().cpu_time_ns();
+    for (uint64_t n=0;n<total;n+=sizeof(block)) cmdConsole._write(block,sizeof(block));
+    drain(base+total);
+    report("_write 64-byte blocks",total,now_ns()-t0,thread_ns()-a0,"_write",muxlink.wt().cpu_time_ns()-w0,"writethread");
+    printf("%-28s %8.2f bytes per tty write\n","",(double)(port.raw)/port.writes);
+
+    // one channel, putc
+    base=port.payload;
+    t0=now_ns(); a0=thread_ns(); w0=muxlink.wt().cpu_time_ns();
+    for (uint64_t n=0;n<total/4;n++) cmdConsole.putc('x');
+    drain(base+total/4);
+    report("putc",total/4,now_ns()-t0,thread_ns()-a0,"_putc",muxlink.wt().cpu_time_ns()-w0,"writethread");
+
+    // formatted lines like the analog thread (second time only wake writethread once a line,
+    // third time on the 4K channel where lines can be formatted in place)
+    for (int pass=0;pass<3;pass++)
+    {
+        static const char *name[]={"printf lines","printf lines, wake on \\n","printf lines, 4K channel"};
+        SerialMux &con=pass==2?bulkConsole:analogConsole;
+        uint64_t lines=total/32, bytes0=port.payload, wr0;
+        con.set_txwake(pass?16:1,pass?'\n':-1);
+        t0=now_ns(); a0=thread_ns(); w0=muxlink.wt().cpu_time_ns();
+        for (uint64_t n=0;n<lines;n++) con.printf(":%d Analog=%d.%d\r\n",(int)n,(int)(n%4),(int)(n%10));
+        wr0=thread_ns()-a0;
+        while (port.payload<bytes0+1) ThisThread::yield();
+        // wait for the channel to empty
+        ThisThread::sleep_for(50ms);
+        uint64_t bytes=port.payload-bytes0;
+        report(name[pass],bytes,now_ns()-t0,wr0,"printf",muxlink.wt().cpu_time_ns()-w0,"writethread");
+        printf("%-28s %8.0f ns/line %6.1f bytes/line\n","",(double)wr0/lines,(double)bytes/lines);
+    }
+    // the same lines as binary log records (the host formats them)
+    {
+        uint64_t lines=total/32, bytes0=port.payload, wr0;
+        t0=now_ns(); a0=thread_ns(); w0=muxlink.wt().cpu_time_ns();
+        for (uint64_t n=0;n<lines;n++) MUXLOG(bulkConsole,":%d Analog=%d.%d\r\n",(int)n,(int)(n%4),(int)(n%10));
+        wr0=thread_ns()-a0;
+        while (port.payload<bytes0+1) ThisThread::yield();
+        ThisThread::sleep_for(50ms);
+        uint64_t bytes=port.payload-bytes0;
+        report("MUXLOG lines, 4K channel",bytes,now_ns()-t0,wr0,"MUXLOG",muxlink.wt().cpu_time_ns()-w0,"writethread");
+        printf("%-28s %8.0f ns/line %6.1f bytes/line\n","",(double)wr0/lines,(double)bytes/lines);
+    }
+
+    // the demo's four channels at once
+    {
+        SerialMux *chans[4]={&analogConsole,&digitalConsole,&debugConsole,&cmdConsole};
+        std::vector<std::thread> writers;
+        std::atomic<uint64_t> appns{0};
+        uint64_t raw0=port.raw, wr0=port.writes;
+        base=port.payload;
+        t0=now_ns(); w0=muxlink.wt().cpu_time_ns();
+        for (int i=0;i<4;i++)
+            writers.emplace_back([&,i]() {
+                char b[32];
+                memset(b,'a'+i,sizeof(b));
+                uint64_t s=thread_ns();
+                for (uint64_t n=0;n<total/4;n+=sizeof(b)) chans[i]->_write(b,sizeof(b));
+                appns+=thread_ns()-s;
+            });
+        for (auto &t : writers) t.join();
+        drain(base+total);
+        report("4 channels, 32-byte writes",total,now_ns()-t0,appns,"_write",muxlink.wt().cpu_time_ns()-w0,"writethread");
+        printf("%-28s %8.2f bytes per tty write\n","",(double)(port.raw-raw0)/(port.writes-wr0));
+    }
+
+    // receive: one channel, consumer reads 64 bytes at a time
+    {
+        std::vector<char> in(total+2,'r');
+        char buf[64];
+        uint64_t got=0,r0;
+        in[0]='\xff';
+        in[1]=10;   // cmdConsole
+        t0=now_ns(); a0=thread_ns(); r0=muxlink.rt().cpu_time_ns();
+        port.feed(in.data(),in.size());
+        cmdConsole.set_blocking(false);
+        while (got+cmdConsole.get_overruns()<total) got+=cmdConsole._read(buf,sizeof(buf));
+        report("_read 64-byte blocks",total,now_ns()-t0,thread_ns()-a0,"_read",muxlink.rt().cpu_time_ns()-r0,"readthread");
+        printf("%-28s %8lu bytes lost to overruns\n","",cmdConsole.get_overruns());
+    }
+    // receive: a 4K channel with a blocking reader, the channel reselected every 512 bytes
+    // and an escaped FF every 256
+    {
+        std::vector<char> in;
+        char buf[1024];
+        uint64_t got=0,r0,lost0=bulkConsole.get_overruns();
+        for (uint64_t n=0;n<total;n++)
+        {
+            if (n%512==0) { in.push_back('\xff'); in.push_back(20); }
+            if (n%256==255) { in.push_back('\xff'); in.push_back('\xfe'); }
+            else in.push_back('b');
+        }
+        bulkConsole.set_wake(1024);
+        t0=now_ns(); a0=thread_ns(); r0=muxlink.rt().cpu_time_ns();
+        port.feed(in.data(),in.size());
+        while (got+bulkConsole.get_overruns()-lost0<total)
+            got+=bulkConsole._read(buf,std::min<uint64_t>(sizeof(buf),total-got-(bulkConsole.get_overruns()-lost0)));
+        report("_read 4K channel, blocking",total,now_ns()-t0,thread_ns()-a0,"_read",muxlink.rt().cpu_time_ns()-r0,"readthread");
+        printf("%-28s %8lu bytes lost to overruns\n","",bulkConsole.get_overruns()-lost0);
+    }
+    // receive: one thread serves four channels, sleeping on an EventFlags their sigio sets
+    // (data comes in 16 byte runs per channel, like four consoles typing at once)
+    {
+        SerialMux *cons[]={&analogConsole,&digitalConsole,&debugConsole,&cmdConsole};
+        const uint8_t ids[]={1,2,100,10};
+        EventFlags ready;
+        std::vector<char> in;
+        char buf[64];
+        uint64_t got=0,wakes=0,r0,lost0=0;
+        for (uint64_t n=0;n<total;n+=16)
+        {
+            in.push_back('\xff');
+            in.push_back(ids[(n/16)%4]);
+            in.insert(in.end(),16,'s');
+        }
+        for (SerialMux *con : cons)
+        {
+            lost0+=con->get_overruns();
+            con->set_blocking(false);
+            con->sigio([&ready]() { ready.set(1); });
+        }
+        t0=now_ns(); a0=thread_ns(); r0=muxlink.rt().cpu_time_ns();
+        port.feed(in.data(),in.size());
+        uint64_t lost=0;
+        while (got+lost<total)
+        {
+            ready.wait_any(1,100);
+            wakes++;
+            lost=0;
+            for (SerialMux *con : cons)
+            {
+                while (con->poll(POLLIN)) got+=con->_read(buf,sizeof(buf));
+                lost+=con->get_overruns();
+            }
+            lost-=lost0;
+        }
+        report("sigio, 1 thread 4 channels",total,now_ns()-t0,thread_ns()-a0,"consumer",muxlink.rt().cpu_time_ns()-r0,"readthread");
+        printf("%-28s %8.1f bytes per wakeup, %lu lost to overruns\n","",(double)got/wakes,lost);
+        for (SerialMux *con : cons)
+        {
+            con->sigio(NULL);
+            con->set_blocking(true);
+        }
+    }
+    // a second link on its own port with its own threads: both send at once on channel 1
+    {
+        static MemTTY port2;
+        static StaticMuxLink<> link2;   // buffers in the object
+        static SerialMux uart(link2,1,SerialMux::BUFFER_SIZE64);
+        uint64_t p0=port.chanbytes[1];
+        link2.start(&port2,false);
+        t0=now_ns();
+        std::thread other([&]() { for (uint64_t n=0;n<total/4;n+=sizeof(block)) uart._write(block,sizeof(block)); });
+        for (uint64_t n=0;n<total/4;n+=sizeof(block)) analogConsole._write(block,sizeof(block));
+        other.join();
+        while (port.chanbytes[1]-p0<total/4 || port2.chanbytes[1]<total/4) ThisThread::yield();
+        printf("%-28s %8.2f MB/s  link %u bytes, first link got %lu, second %lu\n","2 links, 1 channel each",
+               total/2*1000.0/(now_ns()-t0),(unsigned)link2.footprint(),(unsigned long)(port.chanbytes[1]-p0),(unsigned long)port2.chanbytes[1].load());
+    }
+    // 16 command consoles on a link of their own, all run by one EventQueue thread
+    // Lines take turns across the consoles; each is answered with OK on its own channel
+    {
+        static MemTTY port3;
+        static MuxLink link3;
+        static EventQueue queue(16*EVENTS_EVENT_SIZE);
+        static SerialMux *chans[16];
+        static CmdConsole *consoles[16];
+        Thread dispatcher(osPriorityNormal,OS_STACK_SIZE,NULL,"Consoles");
+        uint64_t lines=total/64, answered=0, d0, r0;
+        std::vector<char> in;
+        for (int i=0;i<16;i++)
+        {
+            chans[i]=new SerialMux(link3,50+i,SerialMux::BUFFER_SIZE64);
+            consoles[i]=new CmdConsole(*chans[i],queue,benchprocess,"");
+        }
+        link3.start(&port3,false,true);
+        dispatcher.start(callback(&queue,&EventQueue::dispatch_forever));
+        for (uint64_t n=0;n<lines;n++)
+        {
+            in.push_back('\xff');
+            in.push_back(50+n%16);
+            in.insert(in.end(),{'a','d','d',' ','3','\r','\n'});
+        }
+        addtotal=0;
+        t0=now_ns(); d0=dispatcher.cpu_time_ns(); r0=link3.footprint();
+        port3.feed(in.data(),in.size());
+        while (answered<lines*4)
+        {
+            ThisThread::yield();
+            answered=0;
+            for (int i=0;i<16;i++) answered+=port3.chanbytes[50+i];
+        }
+        uint64_t wall=now_ns()-t0, most=0, least=lines;
+        for (int i=0;i<16;i++)
+        {
+            most=std::max<uint64_t>(most,consoles[i]->get_lines());
+            least=std::min<uint64_t>(least,consoles[i]->get_lines());
+        }
+        printf("%-28s %8.0f cmds/s  %7.0f ns CPU/cmd on the queue thread, total %s\n","16 consoles, 1 thread",
+               lines*1e9/wall,(double)(dispatcher.cpu_time_ns()-d0)/lines,addtotal==lines*3?"right":"WRONG");
+        printf("%-28s %8lu to %lu lines each, %u bytes a console (%u channel, %u CmdConsole)\n","",(unsigned long)least,(unsigned long)most,
+               (unsigned)(r0/16+sizeof(CmdConsole)),(unsigned)(r0/16),(unsigned)sizeof(CmdConsole));
+        queue.break_dispatch();
+        dispatcher.join();
+    }
+    // four threads log 32-byte lines to one channel: a shared mutex (like the demo's debugLog)
+    // against set_mpsc. Every line has to come out whole
+    mpscLog.set_mpsc();
+    mpscMidLog.set_mpsc();
+    mpscBigLog.set_mpsc();
+    for (int pass=0;pass<6;pass++)
+    {
+        SerialMux *logs[6]={&lockedLog,&mpscLog,&lockedMidLog,&mpscMidLog,&lockedBigLog,&mpscBigLog};
+        const char *names[6]={"4 writers, shared mutex","4 writers, set_mpsc","4 writers, mutex, 1K","4 writers, set_mpsc, 1K",
+                              "4 writers, mutex, 8K","4 writers, set_mpsc, 8K"};
+        SerialMux &con=*logs[pass];
+        bool mp=pass&1;
+        Mutex logmtx;
+        uint64_t lines=total/32/4, cpu[4];
+        std::vector<std::thread> writers;
+        port.capture=30+pass;
+        port.captured.clear();
+        port.captured.reserve(total+1024);
+        uint64_t c0=port.chanbytes[port.capture];
+        t0=now_ns();
+        for (int k=0;k<4;k++)
+            writers.emplace_back([&,k]() {
+                char line[32];
+                memset(line,'a'+k,31);
+                line[31]='\n';
+                uint64_t a=thread_ns();
+                for (uint64_t n=0;n<lines;n++)
+                {
+                    if (mp) con.write(line,32);
+                    else
+                    {
+                        logmtx.lock();
+                        con.write(line,32);
+                        logmtx.unlock();
+                    }
+                }
+                cpu[k]=thread_ns()-a;
+            });
+        for (auto &t : writers) t.join();
+        while (port.chanbytes[port.capture]-c0<lines*4*32) ThisThread::yield();
+        uint64_t wall=now_ns()-t0, bad=0;
+        for (size_t i=0;i+32<=port.captured.size();i+=32)
+            if (port.captured[i+31]!='\n' || port.captured.find_first_not_of(port.captured[i],i)!=i+31) bad++;
+        port.capture=-1;
+        printf("%-28s %8.2f MB/s  %7.0f ns/line per writer, %lu of %lu lines mixed up\n",names[pass],
+               lines*4*32*1000.0/wall,(double)(cpu[0]+cpu[1]+cpu[2]+cpu[3])/(lines*4),(unsigned long)bad,(unsigned long)lines*4);
+    }
+    // how many samples a second get through a 115200 baud UART and a 1 MB/s link
+    // as printf lines like the analog thread's and as telemetry frames
+    for (int pass=0;pass<4;pass++)
+    {
+        static const char *names[]={"samples, printf, 115200","samples, telemetry, 115200","samples, printf, 1 MB/s","samples, telemetry, 1 MB/s"};
+        MuxTelemetry tel(telemetryConsole,1);
+        uint64_t n=0, c0=port.chanbytes[40], wall;
+        port.rate=pass<2?11520:1000000;
+        a0=thread_ns();
+        t0=now_ns();
+        while (now_ns()-t0<1000000000ULL)
+        {
+            // slow 12 bit sine plus a little noise
+            int32_t v=2048+(int32_t)(1000*sin(n/100.0))+(int32_t)(n*7919%5)-2;
+            if (pass&1) tel.sample(&v);
+            else telemetryConsole.printf(":%d Analog=%d\r\n",(int)n,(int)v);
+            n++;
+        }
+        tel.flush();
+        wall=now_ns()-t0;
+        printf("%-28s %8.0f samples/s  %5.1f bytes/sample  %6.0f ns CPU/sample\n",names[pass],
+               n*1e9/wall,(double)(port.chanbytes[40]-c0)/n,(double)(thread_ns()-a0)/n);
+        ThisThread::sleep_for(100ms);   // let the channel empty
+        port.rate=0;
+    }
+    // latency of short replies on the command channel while three others flood a 1 MB/s link
+    // (like full speed USB), first with equal priorities, then with the command channel higher
+    // With one frame quanta a reply waits at most three frames either way. With 1K quanta it
+    // waits for up to three quanta taking turns, but only the one being sent with priority
+    for (int pass=0;pass<4;pass++)
+    {
+        static const char *names[]={"cmd latency, same priority","cmd latency, cmd priority 1",
+                                    "same priority, 1K quanta","cmd priority 1, 1K quanta"};
+        std::atomic<bool> stop{false};
+        std::vector<uint64_t> lat;
+        port.rate=1000000;
+        cmdConsole.set_priority(pass&1);
+        std::vector<std::thread> flood;
+        std::vector<SerialMux *> busy={&bulkConsole,&debugConsole,&digitalConsole};
+        if (pass>=2) busy={&bulkConsole,&lockedMidLog,&lockedBigLog};   // buffers that hold a quantum
+        for (SerialMux *con : busy)
+        {
+            con->set_priority(0,pass<2?0:1024);
+            flood.emplace_back([&,con]() {
+                char b[1024];
+                memset(b,'d',sizeof(b));
+                while (!stop) con->_write(b,sizeof(b));
+            });
+        }
+        ThisThread::sleep_for(50ms);
+        uint64_t fl0=port.chanbytes[20], ft0=now_ns();
+        for (int i=0;i<100;i++)
+        {
+            uint64_t seen=port.chanbytes[10], t=now_ns();
+            cmdConsole._write("OK\r\n",4);
+            while (port.chanbytes[10]<seen+4) ThisThread::yield();
+            lat.push_back(now_ns()-t);
+            ThisThread::sleep_for(2ms);
+        }
+        double flood_mbs=(port.chanbytes[20]-fl0)*1000.0/(now_ns()-ft0);
+        stop=true;
+        for (auto &t : flood) t.join();
+        for (SerialMux *con : busy)
+        {
+            con->oflush();
+            con->set_priority(0);
+        }
+        std::sort(lat.begin(),lat.end());
+        printf("%-28s %8.0f us median %8.0f us max (4K channel got %.2f MB/s)\n",names[pass],
+               lat[lat.size()/2]/1000.0,lat.back()/1000.0,flood_mbs);
+        port.rate=0;
+        ThisThread::sleep_for(50ms);
+    }
+    // the mux threads never stop (just like on the board) so don't run destructors under them
+    fflush(stdout);
+    _Exit(0);
+}
@@ -3,15 +3,21 @@
 This opens up 4 "consoles" over the USB serial port
 
 1) An analog console that reads an analog channel periodically and prints the value
+   (and the same samples as binary telemetry on channel 3)
 2) A digital console that reads the built in switch and also displays a text tag
 3) A debug console with informational messages
 4) A command console that lets you change some timings and other parameters
+   (it runs from an EventQueue, so more consoles could share its thread, see CmdConsole.h)
+   (a program can get and set the same parameters in binary on channel 250, see MuxRPC.h)
 
 You need the Linux server running:
 
 
 Linux server command line:
-ttymux -s -c 1:analogport.virtual -c 2:digitalport.virtual -c 100:debugport.virtual -c 10:cmdport.virtual
+ttymux -s -c 1:analogport.virtual -c 2:digitalport.virtual -c 10:cmdport.virtual -F muxlog.fmt -c 100:debugport.virtual -T csv -c 3:telemetry.virtual -T none -F - -c 250:rpc.virtual
+
+The debug console sends binary log records (MuxLog.h). Get muxlog.fmt from the build with:
+arm-none-eabi-objcopy -O binary -j muxlog_fmt firmware.elf muxlog.fmt
 
 You then connect to the ports using something like picocom. For the command port you may want:
 
@@ -36,11 +42,15 @@ help - Get this list of commands
 #include "mbed.h"
 #include "USBSerial.h"
 #include "SerialMux.h"
+#include "MuxLog.h"
+#include "MuxTelemetry.h"
+#include "MuxRPC.h"
+#include "CmdConsole.h"
 
 
 #include "cmds.h"
 
-char cmdstr[32]="None";
+char cmdstr[CMDSTR_SIZE]="None";
 
 
 
@@ -63,33 +73,36 @@ namespace mbed
 
 }
 
-// Create the virtual serial ports
-SerialMux analogConsole(1,SerialMux::BUFFER_SIZE16),
-          digitalConsole(2,SerialMux::BUFFER_SIZE16),
-          debugConsole(100,SerialMux::BUFFER_SIZE16),
-          cmdConsole(10,SerialMux::BUFFER_SIZE64);
+// Create the virtual serial ports (IDs and sizes are fixed, so the buffers are part of each object)
+StaticSerialMux<1,SerialMux::BUFFER_SIZE16> analogConsole;
+StaticSerialMux<2,SerialMux::BUFFER_SIZE16> digitalConsole;
+StaticSerialMux<100,SerialMux::BUFFER_SIZE16,SerialMux::BUFFER_SIZE1K> debugConsole;   // 2*MuxLog::MAXREC+4 or more, so every record fits (set_mpsc)
+StaticSerialMux<10,SerialMux::BUFFER_SIZE64> cmdConsole;
+StaticSerialMux<3,SerialMux::BUFFER_SIZE16,SerialMux::BUFFER_SIZE256> telemetryConsole;
+StaticSerialMux<MuxRPC::CHANNEL,SerialMux::BUFFER_SIZE256> rpcConsole;   // room for a few requests in flight
+
+// The command console runs from this queue's thread (room for more consoles)
+EventQueue cmdQueue(4*EVENTS_EVENT_SIZE);
+CmdConsole commandConsole(cmdConsole,cmdQueue,cmdprocess);
+
+// analog samples in millivolts, batched into a frame about once a second
+MuxTelemetry analogTelemetry(telemetryConsole,1,255,1000);
 
 
 DigitalOut led(LED1);
 
 // Writing to one port from multiple threads is OK, but it is possible to mix up output
-// So all writes to debugConsole come through here
-
-void debugLog(const char*s)
-{
-    static Mutex Logmtx;
-    Logmtx.lock();
-    debugConsole.puts(s);
-    Logmtx.unlock();
-}
+// debugConsole is in multi-producer mode (see main) so each MUXLOG record comes out in one
+// piece without a lock, and it is safe from an interrupt handler too
+// The records are a few bytes each and ttymux -F turns them back into text
 
 
 
 
 
-void commandThread()
+void rpcThread()
 {
-    cmdloop(&cmdConsole);  // never returns
+    rpcloop(&rpcConsole);  // never returns
 }
 
 void digitalThread()
@@ -102,7 +115,7 @@ void digitalThread()
     while (1)
     {
         int v=btn;
-        debugLog(":Enter digital loop\r\n");
+        MUXLOG(debugConsole,":Enter digital loop %u\r\n",n);
         // press anything but a space on the digital console and it will pause
         // until you press a space
         if (digitalConsole.readable())
@@ -122,7 +135,7 @@ void analogThread()
 
     while (1)
     {
-        debugLog(":Enter analog loop\r\n");
+        MUXLOG(debugConsole,":Enter analog loop %u\r\n",n);
         // press anything but a space on the analog console and it will pause
         // until you press a space
         if (analogConsole.readable())
@@ -130,6 +143,8 @@ void analogThread()
             while (analogConsole._getc()!=' ') ThisThread::sleep_for(100ms);
         }
         float f=ain;
+        int32_t mv=f*3300;
+        analogTelemetry.sample(&mv);
        analogConsole.printf(":%d Analog=%d.%d\r\n",n++,(int)(f*33/10.0),((int)(f*33))%10);
         ThisThread::sleep_for(std::chrono::milliseconds(arate));
     }
@@ -141,13 +156,18 @@ int main()
 
 {
     int connected, lastconnected=0;
+    bool mpsc;
     usbSerial.connect();
+    cmdConsole.set_priority(1);   // command replies go ahead of a busy debug console
+    mpsc=debugConsole.set_mpsc();   // several threads log here (MUXLOG); if not, each record takes the channel's lock
     SerialMux::start(&usbSerial);
     Thread analog(osPriorityNormal,OS_STACK_SIZE,NULL,"Analog"), digital(osPriorityNormal,OS_STACK_SIZE,NULL,"Digital");
     Thread command(osPriorityNormal,OS_STACK_SIZE,NULL,"Command");
+    Thread rpc(osPriorityNormal,OS_STACK_SIZE,NULL,"RPC");
     analog.start(analogThread);
     digital.start(digitalThread);
-    command.start(commandThread);
+    command.start(callback(&cmdQueue,&EventQueue::dispatch_forever));
+    rpc.start(rpcThread);
 
     while (1)
     {
@@ -165,6 +185,11 @@ int main()
             clearerr(digitalConsole);
             clearerr(debugConsole);
             clearerr(cmdConsole);
+            clearerr(telemetryConsole);
+            clearerr(rpcConsole);
+            // debugConsole only carries log records, so say it here
+            if (!mpsc) cmdConsole.puts("debugConsole is not in multi-producer mode\r\n");
+            commandConsole.start();   // prompt
 
         }
         lastconnected=connected;  // remember for next time#endif
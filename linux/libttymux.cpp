@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <cstring>
+#include <deque>
+
+// Coroutine channels for libttymux (see libttymux.h)
+
+#include "libttymux.h"
+
+pthread_t muxloop::thread=(pthread_t)NULL;
+pthread_mutex_t muxloop::mtx=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t muxloop::cond=PTHREAD_COND_INITIALIZER;
+static std::deque<std::coroutine_handle<>> ready;  // coroutines to resume (muxloop::mtx)
+
+// Queue a coroutine to resume on the loop thread
+void muxloop::post(std::coroutine_handle<> h)
+{
+  pthread_mutex_lock(&mtx);
+  if (!thread && pthread_create(&thread,NULL,run,NULL))
+    {
+      perror("muxloop");
+      exit(1);
+    }
+  ready.push_back(h);
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&mtx);
+}
+
+// The loop: resume whatever is ready
+void *muxloop::run(void *arg)
+{
+  pthread_mutex_lock(&mtx);
+  while (1)
+    {
+      std::coroutine_handle<> h;
+      while (ready.empty()) pthread_cond_wait(&cond,&mtx);
+      h=ready.front();
+      ready.pop_front();
+      pthread_mutex_unlock(&mtx);
+      h.resume();
+      pthread_mutex_lock(&mtx);
+    }
+  return NULL;
+}
+
+muxchannel::muxchannel(ttydev *dev, int id) : ttychan(dev)
+{
+  pthread_mutex_init(&mtx,NULL);
+  rx=new unsigned char[RXSIZE];
+  rxhead=rxlen=0;
+  drops=0;
+  rbuf=NULL;
+  rlen=0;
+  rresult=NULL;
+  wbuf=NULL;
+  wleft=0;
+  wresult=NULL;
+  rxlimit=RXSIZE;   // don't grant more credit than rx holds
+  start(id,false);   // no pty
+}
+
+// Finish a read or write still waiting on us with -1 (they resume on the loop thread and
+// don't look at the channel again)
+muxchannel::~muxchannel()
+{
+  detach();  // the device threads are done with us once this returns
+  txlock();
+  if (writer)
+    {
+      *wresult=-1;
+      muxloop::post(writer);
+      writer=nullptr;
+    }
+  txunlock();
+  pthread_mutex_lock(&mtx);
+  if (reader)
+    {
+      *rresult=-1;
+      muxloop::post(reader);
+      reader=nullptr;
+    }
+  pthread_mutex_unlock(&mtx);
+  delete [] rx;
+}
+
+// Copy received data out (mtx held) and give the other side credit for it
+size_t muxchannel::take(void *buf, size_t n)
+{
+  unsigned char *p=(unsigned char *)buf;
+  size_t k,first;
+  if (n>rxlen) n=rxlen;
+  first=RXSIZE-rxhead;
+  if (first>n) first=n;
+  memcpy(p,rx+rxhead,first);
+  memcpy(p+first,rx,n-first);
+  rxhead=(rxhead+n)%RXSIZE;
+  rxlen-=n;
+  k=n;
+  returncredit(k);
+  return k;
+}
+
+// Received data (device read thread): keep it and finish a waiting read
+void muxchannel::deliver(const unsigned char *buf, int n, const struct timespec &ts)
+{
+  int room;
+  if (n<=0) return;
+  if (log) log->write(buf,n);
+  pthread_mutex_lock(&mtx);
+  room=RXSIZE-rxlen;
+  if (n>room)
+    {
+      // only happens without flow control
+      drops+=n-room;
+      returncredit(n-room);
+      n=room;
+    }
+  while (n>0)
+    {
+      unsigned tail=(rxhead+rxlen)%RXSIZE;
+      unsigned k=RXSIZE-tail;
+      if (k>(unsigned)n) k=n;
+      memcpy(rx+tail,buf,k);
+      rxlen+=k;
+      buf+=k;
+      n-=k;
+    }
+  if (reader)
+    {
+      std::coroutine_handle<> h=reader;
+      *rresult=take(rbuf,rlen);
+      reader=nullptr;
+      muxloop::post(h);
+    }
+  pthread_mutex_unlock(&mtx);
+}
+
+// Queued data went out (write thread, txmtx held): queue more for a waiting write
+void muxchannel::sent(int n)
+{
+  int k;
+  if (!writer) return;
+  k=requeue(wbuf,wleft);
+  wbuf+=k;
+  wleft-=k;
+  if (wleft==0)
+    {
+      std::coroutine_handle<> h=writer;
+      writer=nullptr;
+      muxloop::post(h);
+    }
+}
+
+// co_await ch.read(): take what is there or wait for the device to deliver
+bool muxchannel::readop::await_suspend(std::coroutine_handle<> h)
+{
+  pthread_mutex_lock(&ch->mtx);
+  if (ch->rxlen)
+    {
+      result=ch->take(buf,n);
+      pthread_mutex_unlock(&ch->mtx);
+      return false;  // don't suspend
+    }
+  ch->reader=h;
+  ch->rbuf=(unsigned char *)buf;
+  ch->rlen=n;
+  ch->rresult=&result;
+  pthread_mutex_unlock(&ch->mtx);
+  return true;
+}
+
+// co_await ch.write(): hand over what fits and wait for the write thread to take the rest
+bool muxchannel::writeop::await_suspend(std::coroutine_handle<> h)
+{
+  int k;
+  ch->txlock();
+  k=ch->requeue(buf,n);
+  if ((size_t)k==n)
+    {
+      ch->txunlock();
+      return false;
+    }
+  ch->writer=h;
+  ch->wbuf=buf+k;
+  ch->wleft=n-k;
+  ch->wresult=&result;
+  ch->txunlock();
+  return true;
+}
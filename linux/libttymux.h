@@ -0,0 +1,117 @@
+#ifndef __LIBTTYMUX_H
+#define __LIBTTYMUX_H
+
+/*
+Talk to mux channels from your own program (C++20 coroutines) instead of through ptys.
+
+    ttydev dev;
+    muxchannel cmd(&dev,10);        // make channels before run
+    dev.run("/dev/ttyACM0");
+
+    muxtask talk(muxchannel &ch)
+    {
+      char buf[256];
+      co_await ch.write("help\r\n",6);
+      ssize_t n=co_await ch.read(buf,sizeof(buf));   // waits for at least 1 byte
+      ...
+    }
+
+    muxspawn(talk(cmd));
+
+Coroutines run on the library's event loop thread (started by the first muxspawn), never on
+the device threads. A read finishes as soon as there is any data. A write finishes once all
+of the data has been handed to the device (it may still be waiting for credit in the channel).
+Received data waits in the channel (up to RXSIZE bytes) until you read it; with flow control
+the device only gets credit back as you read (and never more than RXSIZE, whatever the window),
+otherwise data that does not fit is dropped. If a muxchannel is destroyed while a read or write
+waits on it, that read or write finishes with -1. A muxchannel may be destroyed while its
+device runs: it leaves the device (and the device threads let go of it) before its buffer goes.
+*/
+
+#include <coroutine>
+#include <exception>
+#include <sys/types.h>
+#include <pthread.h>
+#include "ttymux.h"
+
+// A coroutine you start with muxspawn. It runs until it returns
+struct muxtask
+{
+  struct promise_type
+  {
+    muxtask get_return_object() { return muxtask{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+    std::suspend_always initial_suspend() noexcept { return {}; }  // muxspawn starts it
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+  std::coroutine_handle<promise_type> handle;
+};
+
+// The event loop that resumes coroutines
+class muxloop
+{
+protected:
+  static pthread_t thread;
+  static pthread_mutex_t mtx;
+  static pthread_cond_t cond;
+  static void *run(void *arg);
+public:
+  // resume h on the loop thread (starts the loop if needed)
+  static void post(std::coroutine_handle<> h);
+};
+
+// start a task on the loop
+inline void muxspawn(muxtask t) { muxloop::post(t.handle); }
+
+// A channel your program reads and writes directly
+class muxchannel : public ttychan
+{
+protected:
+  pthread_mutex_t mtx;     // protects the receive side
+  unsigned char *rx;       // received data waiting for read
+  unsigned rxhead, rxlen;
+  unsigned long drops;     // received bytes lost because rx was full
+  std::coroutine_handle<> reader;  // waiting read (mtx)
+  unsigned char *rbuf;
+  size_t rlen;
+  ssize_t *rresult;
+  std::coroutine_handle<> writer;  // waiting write (dev->txmtx)
+  const unsigned char *wbuf;
+  size_t wleft;
+  ssize_t *wresult;
+  size_t take(void *buf, size_t n);  // mtx held
+  void deliver(const unsigned char *buf, int n, const struct timespec &ts) override;
+  void sent(int n) override;
+public:
+  static const unsigned RXSIZE=65536;
+  muxchannel(ttydev *dev, int id);
+  ~muxchannel();
+  unsigned long getDrops(void) { return drops; }
+
+  struct readop
+  {
+    muxchannel *ch;
+    void *buf;
+    size_t n;
+    ssize_t result;
+    bool await_ready() { return n==0; }
+    bool await_suspend(std::coroutine_handle<> h);
+    ssize_t await_resume() { return n?result:0; }
+  };
+  struct writeop
+  {
+    muxchannel *ch;
+    const unsigned char *buf;
+    size_t n;
+    ssize_t result;
+    bool await_ready() { return n==0; }
+    bool await_suspend(std::coroutine_handle<> h);
+    ssize_t await_resume() { return result; }
+  };
+  // co_await these (-1 if the channel goes away while they wait)
+  readop read(void *buf, size_t n) { return readop{this,buf,n,0}; }
+  writeop write(const void *buf, size_t n) { return writeop{this,(const unsigned char *)buf,n,(ssize_t)n}; }
+};
+
+#endif
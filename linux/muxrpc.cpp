@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+#include <poll.h>
+
+// Binary parameter client (see muxrpc.h and MuxRPC.h on the device)
+
+#include "muxrpc.h"
+
+static bool putvar(unsigned char *buf, int &len, uint32_t v)
+{
+  do
+    {
+      if (len>=muxrpc::MAXREC) return false;
+      buf[len++]=(v&0x7f)|(v>0x7f?0x80:0);
+      v>>=7;
+    } while (v);
+  return true;
+}
+
+static bool takevar(const unsigned char *buf, int len, int &pos, uint32_t *v)
+{
+  *v=0;
+  for (int shift=0;pos<len;shift+=7)
+    {
+      if (shift<32) *v|=(uint32_t)(buf[pos]&0x7f)<<shift;
+      if (!(buf[pos++]&0x80)) return true;
+    }
+  return false;
+}
+
+bool muxrpc::request::get(int idx)
+{
+  if (idx<0 || idx>255 || len+2>MAXREC) return false;
+  buf[len++]=OP_GET;
+  buf[len++]=idx;
+  return true;
+}
+
+bool muxrpc::request::info(int idx)
+{
+  if (idx<0 || idx>255 || len+2>MAXREC) return false;
+  buf[len++]=OP_INFO;
+  buf[len++]=idx;
+  return true;
+}
+
+bool muxrpc::request::set(int idx, uint32_t v)
+{
+  int save=len;
+  if (idx<0 || idx>255 || len+3>MAXREC) return false;
+  buf[len++]=OP_SET;
+  buf[len++]=idx;
+  buf[len++]=VAL_UINT;
+  if (putvar(buf,len,v)) return true;
+  len=save;
+  return false;
+}
+
+bool muxrpc::request::set(int idx, const char *s)
+{
+  size_t n=strlen(s);
+  if (idx<0 || idx>255 || n>255 || len+4+(int)n>MAXREC) return false;
+  buf[len++]=OP_SET;
+  buf[len++]=idx;
+  buf[len++]=VAL_STR;
+  buf[len++]=n;
+  memcpy(buf+len,s,n);
+  len+=n;
+  return true;
+}
+
+// take a value into it (false if the reply is malformed)
+static bool takevalue(const unsigned char *buf, int len, int &pos, muxrpc::item &it)
+{
+  int n;
+  if (pos>=len) return false;
+  it.type=buf[pos++];
+  switch (it.type)
+    {
+    case muxrpc::VAL_NONE:
+      return true;
+    case muxrpc::VAL_UINT:
+      return takevar(buf,len,pos,&it.num);
+    case muxrpc::VAL_STR:
+      if (pos>=len || len-pos-1<buf[pos]) return false;
+      n=buf[pos++];
+      memcpy(it.str,buf+pos,n);
+      it.str[n]='\0';
+      pos+=n;
+      return true;
+    }
+  return false;
+}
+
+bool muxrpc::reply::next(item &it)
+{
+  if (pos+2>len) return false;
+  it.op=buf[pos++];
+  it.status=buf[pos++];
+  it.type=VAL_NONE;
+  it.name[0]='\0';
+  if (it.status!=RPC_OK) return true;
+  if (it.op==OP_INFO)
+    {
+      if (!takevalue(buf,len,pos,it) || it.type!=VAL_STR) return false;
+      strcpy(it.name,it.str);
+    }
+  if (it.op==OP_GET || it.op==OP_INFO) return takevalue(buf,len,pos,it);
+  return true;
+}
+
+muxrpc::muxrpc(int fd)
+{
+  this->fd=fd;
+  ownfd=false;
+  nextid=0;
+  rlen=0;
+  params=NULL;
+  nparams=0;
+}
+
+muxrpc::~muxrpc()
+{
+  if (ownfd) close(fd);
+  free(params);
+}
+
+int muxrpc::open(const char *path)
+{
+  struct termios info;
+  if (ownfd) close(fd);
+  fd=::open(path,O_RDWR|O_NOCTTY);
+  ownfd=fd>=0;
+  if (fd<0) return -1;
+  if (tcgetattr(fd,&info)==0)
+    {
+      cfmakeraw(&info);
+      tcsetattr(fd,TCSANOW,&info);
+    }
+  return 0;
+}
+
+void muxrpc::begin(request &r)
+{
+  r.id=nextid++;
+  r.buf[1]=r.id;
+  r.buf[2]=r.id>>8;
+  r.len=3;
+}
+
+int muxrpc::send(request &r)
+{
+  const unsigned char *p=r.buf;
+  int n=r.len;
+  r.buf[0]=r.len-1;
+  while (n>0)
+    {
+      int rv=write(fd,p,n);
+      if (rv<0 && errno==EINTR) continue;
+      if (rv<=0) return -1;
+      p+=rv;
+      n-=rv;
+    }
+  return r.id;
+}
+
+int muxrpc::recv(reply &r, int timeout_ms)
+{
+  while (1)
+    {
+      struct pollfd pfd;
+      int rv;
+      // a whole record waiting?
+      if (rlen && rlen>=rbuf[0]+1)
+	{
+	  int n=rbuf[0];
+	  memcpy(r.buf,rbuf+1,n);
+	  rlen-=n+1;
+	  memmove(rbuf,rbuf+n+1,rlen);
+	  if (n<2) continue;   // no ID, can't be ours
+	  r.len=n;
+	  r.pos=2;
+	  r.id=r.buf[0]|(r.buf[1]<<8);
+	  return 0;
+	}
+      pfd.fd=fd;
+      pfd.events=POLLIN;
+      rv=poll(&pfd,1,timeout_ms);
+      if (rv<0 && errno==EINTR) continue;
+      if (rv<=0) return -1;
+      rv=read(fd,rbuf+rlen,sizeof(rbuf)-rlen);
+      if (rv<0 && (errno==EINTR || errno==EAGAIN)) continue;
+      if (rv<=0) return -1;
+      rlen+=rv;
+    }
+}
+
+// send one request and wait for its reply's first item
+int muxrpc::call(request &r, item &it)
+{
+  reply a;
+  int id=send(r);
+  if (id<0) return -1;
+  do
+    {
+      if (recv(a)) return -1;
+    } while (a.id!=id);   // something we didn't wait for
+  if (!a.next(it)) return -1;
+  return it.status;
+}
+
+int muxrpc::discover(void)
+{
+  int idx=0;
+  if (!params) params=(param *)malloc(256*sizeof(param));
+  nparams=0;
+  while (idx<256)
+    {
+      request r;
+      reply a;
+      item it;
+      int id;
+      begin(r);
+      for (int k=0;k<16 && idx+k<256;k++) r.info(idx+k);
+      if ((id=send(r))<0) return -1;
+      do
+	{
+	  if (recv(a)) return -1;
+	} while (a.id!=id);
+      while (a.next(it))
+	{
+	  if (it.status==RPC_NOTFOUND) return nparams;
+	  if (it.status==RPC_FULL) break;   // ask again from here
+	  if (it.status!=RPC_OK) return -1;
+	  strcpy(params[idx].name,it.name);
+	  params[idx].type=it.type;
+	  nparams=++idx;
+	}
+    }
+  return nparams;
+}
+
+int muxrpc::find(const char *name)
+{
+  for (int i=0;i<nparams;i++)
+    if (!strcmp(params[i].name,name)) return i;
+  return -1;
+}
+
+int muxrpc::get(const char *name, uint32_t *v)
+{
+  request r;
+  item it;
+  int st;
+  begin(r);
+  if (!r.get(find(name))) return -1;
+  if ((st=call(r,it))!=RPC_OK) return st;
+  if (it.type!=VAL_UINT) return RPC_TYPE;
+  *v=it.num;
+  return RPC_OK;
+}
+
+int muxrpc::get(const char *name, char *buf, size_t size)
+{
+  request r;
+  item it;
+  int st;
+  begin(r);
+  if (!r.get(find(name))) return -1;
+  if ((st=call(r,it))!=RPC_OK) return st;
+  if (it.type!=VAL_STR) return RPC_TYPE;
+  snprintf(buf,size,"%s",it.str);
+  return RPC_OK;
+}
+
+int muxrpc::set(const char *name, uint32_t v)
+{
+  request r;
+  item it;
+  begin(r);
+  if (!r.set(find(name),v)) return -1;
+  return call(r,it);
+}
+
+int muxrpc::set(const char *name, const char *s)
+{
+  request r;
+  item it;
+  begin(r);
+  if (!r.set(find(name),s)) return -1;
+  return call(r,it);
+}
@@ -0,0 +1,112 @@
+#ifndef __MUXRPC_H
+#define __MUXRPC_H
+
+/*
+Client for the device's binary parameter protocol (MuxRPC.h in the device code).
+
+Talk to the RPC channel through its pseudoterminal (ttymux -c 250:rpc.virtual) or any
+other file descriptor that carries the channel:
+
+    muxrpc rpc;
+    rpc.open("rpc.virtual");
+    rpc.discover();                     // learn the parameter names
+    rpc.set("arate",100);
+    rpc.get("note",buf,sizeof(buf));
+
+Those each wait for their reply. To batch or pipeline, build requests yourself. A request
+can hold many items, and you can send several requests before reading the replies (they
+come back in order with the request's ID):
+
+    muxrpc::request r;
+    rpc.begin(r);
+    r.set(rpc.find("arate"),100);
+    r.set(rpc.find("drate"),250);
+    r.get(rpc.find("blink"));
+    rpc.send(r);
+    ...
+    muxrpc::reply a;
+    muxrpc::item it;
+    rpc.recv(a);
+    while (a.next(it)) ...
+
+Keep what is in flight under the device's input buffer (256 bytes in the demo).
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+class muxrpc
+{
+public:
+  // these match the device
+  enum { OP_GET=1, OP_SET, OP_INFO };
+  enum { RPC_OK=0, RPC_NOTFOUND, RPC_TYPE, RPC_SIZE, RPC_FULL, RPC_BAD, RPC_RANGE };
+  enum { VAL_NONE=0, VAL_UINT, VAL_STR };
+  static const int MAXREC=256;
+
+  struct request
+  {
+    unsigned char buf[MAXREC];
+    int len;
+    int id;
+    // add items (false if the request is full or idx<0)
+    bool get(int idx);
+    bool set(int idx, uint32_t v);
+    bool set(int idx, const char *s);
+    bool info(int idx);
+  };
+  struct item
+  {
+    int op, status;
+    int type;        // VAL_xxx of the value (GET and INFO)
+    uint32_t num;    // VAL_UINT
+    char str[256];   // VAL_STR
+    char name[256];  // INFO
+  };
+  struct reply
+  {
+    unsigned char buf[MAXREC];
+    int len, pos;
+    int id;
+    // next item (false at the end)
+    bool next(item &it);
+  };
+
+  muxrpc(int fd=-1);
+  ~muxrpc();
+  int open(const char *path);
+  int getFD(void) { return fd; }
+  // start a request (gives it the next ID)
+  void begin(request &r);
+  // send a request; returns its ID (-1 on error)
+  int send(request &r);
+  // wait for the next reply (0 if OK, -1 on timeout or error)
+  int recv(reply &r, int timeout_ms=1000);
+  // ask the device for its parameters; returns how many table entries there are (-1 on error)
+  int discover(void);
+  // table index of a parameter (-1 if unknown)
+  int find(const char *name);
+  int count(void) { return nparams; }
+  const char *name(int idx) { return idx>=0 && idx<nparams?params[idx].name:NULL; }
+  int type(int idx) { return idx>=0 && idx<nparams?params[idx].type:VAL_NONE; }
+  // one item, one round trip (RPC_xxx status, -1 on error)
+  int get(const char *name, uint32_t *v);
+  int get(const char *name, char *buf, size_t size);
+  int set(const char *name, uint32_t v);
+  int set(const char *name, const char *s);
+protected:
+  int fd;
+  bool ownfd;
+  uint16_t nextid;
+  unsigned char rbuf[4096];   // received bytes not yet taken as replies
+  int rlen;
+  struct param
+  {
+    char name[256];
+    int type;
+  } *params;
+  int nparams;
+  int call(request &r, item &it);
+};
+
+#endif
@@ -0,0 +1,783 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <errno.h>
+#include <cstring>
+#include <signal.h>
+#include <poll.h>
+
+
+// The ttymux engine (part of libttymux)
+// Note that creating symlinks doesn't really check much
+// And will delete anything it creates on normal exit
+// So be careful if you run this as root (which you probably shouldn't)
+
+
+// Each device (ttydev) maintains a list of its virtual ttys (vttys)
+
+#include "ttymux.h"
+
+ttydev *ttydev::devhead=NULL;  // all the devices
+int ttychan::autodelete=0;
+int ttychan::nottysetup=0;
+int ttychan::v2proto=1;
+bool ttychan::sync=false;
+bool ttychan::credits=false;
+int ttychan::window=4096;
+
+// Clean up on destruct or explicit request
+void ttychan::cleanup(void)
+{
+  if (pty>=0) close(pty);
+  if (link && autodelete)
+    {
+      unlink(link);
+    }
+}
+
+// Walk the lists and clean up everyone
+void ttydev::cleanupAll(void)
+{
+  ttydev *d;
+  ttychan *p;
+  for (d=devhead;d;d=d->next)
+    for (p=d->chanhead;p;p=p->next)
+      {
+	p->cleanup();
+      }
+}
+
+// Destructor -- not always called (e.g., on exit()).
+ttychan::~ttychan()
+{
+  detach();   // a subclass may have done it already
+  cleanup();
+  delete [] rq;
+  delete [] tail;
+}
+
+
+ttychan::ttychan(ttydev *dev)
+{
+  this->dev=dev;
+  next=NULL;   // start() puts us on the device
+  link=NULL;
+  pty=-1;
+  id=-1;
+  tsmode=TS_NONE;
+  bol=true;
+  log=NULL;
+  route=NULL;
+  rq=NULL;
+  rqhead=rqlen=0;
+  routedrops=0;
+  ptyfull=false;
+  hungup=false;
+  tail=NULL;
+  tailoff=taillen=tailsize=0;
+  tailcredit=0;
+  recdrops=0;
+  txcredit=0;
+  txflow=false;
+  rxowed=0;
+  rxlimit=0;
+}
+
+ttydev::ttydev()
+{
+  tty=-1;
+  chanhead=NULL;
+  readthread=writethread=(pthread_t)NULL;
+  cinput=0;
+  coutput=-1;
+  wakefd[0]=wakefd[1]=-1;
+  syncreq=false;
+  tails=0;
+  rxcur=NULL;
+  pthread_mutex_init(&txmtx,NULL);
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  // the threads take it over and over, so a channel being removed has to get in ahead of them
+  pthread_rwlockattr_setkind_np(&attr,PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&chlock,&attr);
+  pthread_rwlockattr_destroy(&attr);
+  next=devhead;
+  devhead=this;
+}
+
+// Put a channel on our list (ttychan::start)
+void ttydev::addchan(ttychan *ch)
+{
+  pthread_rwlock_wrlock(&chlock);
+  ch->next=chanhead;
+  chanhead=ch;
+  pthread_rwlock_unlock(&chlock);
+}
+
+// Take a channel off our list. Once this returns neither thread is using it
+void ttydev::removechan(ttychan *ch)
+{
+  ttychan **b4;
+  pthread_rwlock_wrlock(&chlock);
+  for (b4=&chanhead;*b4 && *b4!=ch;b4=&(*b4)->next);
+  if (*b4) *b4=ch->next;
+  if (rxcur==ch) rxcur=NULL;   // the read thread picks another
+  pthread_rwlock_unlock(&chlock);
+}
+
+// Find a vtty by id
+ttychan *ttydev::find(int id)
+{
+  ttychan *p;
+  for (p=chanhead;p;p=p->next) if (p->id==id) return p;
+  return NULL;
+}
+
+// Connect two channels. Each one's input goes out the other
+void ttychan::connect(ttychan *a, ttychan *b)
+{
+  a->route=b;
+  b->route=a;
+  if (!a->rq) a->rq=new unsigned char[RQSIZE];
+  if (!b->rq) b->rq=new unsigned char[RQSIZE];
+}
+
+// Open with a filename. Again, only once per device
+int ttydev::run(const char *fn)
+{
+  int ftty=open(fn,O_RDWR|O_NOCTTY|O_SYNC|  O_NONBLOCK);
+  if (ftty<0)
+    {
+      perror(fn);
+      return -1;
+    }
+  else
+    return run(ftty);
+}
+
+// user override to tweak handle settings
+// Note type==1 for tty, 0 for vttys
+void ttychan::adjustfile(int type,struct termios *info)
+{
+  return;
+}
+
+// Prep a file handle (type==1 for tty, 0 for vttys)
+int ttychan::prepfhandle(int handle, int type)
+{
+  struct termios info;
+  tcgetattr(handle,&info);
+  if ((type==1 && nottysetup==0)||type==0)
+      {
+      cfmakeraw(&info);
+      info.c_cflag&=~CRTSCTS;
+      info.c_cflag|=(CLOCAL|CREAD);
+      info.c_cflag&= ~CSIZE;
+      info.c_oflag&=~OPOST;
+      info.c_cc[VTIME]=0;
+      info.c_cc[VMIN]=0;
+      }
+  adjustfile(type,&info);
+  return tcsetattr(handle,TCSANOW,&info);
+
+}
+
+// Run the server. If you haven't already passed a base tty
+// you must do so now
+int ttydev::run(int basetty)
+{
+  int rv=0;
+  if (basetty>0) tty=basetty;
+  if (readthread || writethread) return 2; // don't call me more than once!
+  tcflush(tty,TCIOFLUSH);
+  // this should be in an override and check errors?
+  if (ttychan::prepfhandle(tty,1)) perror("TTY set attribute");
+  if (pipe(wakefd)) return -1;
+  fcntl(wakefd[0],F_SETFL,O_NONBLOCK);
+  fcntl(wakefd[1],F_SETFL,O_NONBLOCK);
+  // everyone starts out owing the other side a full window
+  if (ttychan::credits)
+    for (ttychan *p=chanhead;p;p=p->next) p->rxowed=p->rxwindow();
+  // check threads and if needed start them up
+  rv=pthread_create(&readthread, NULL, rthread,this);
+  if (rv==0)
+      rv=pthread_create(&writethread,NULL,wthread,this);
+  return rv;
+}
+
+
+// Start a vtty with the given id
+int ttychan::start(int id, bool openpty)
+  {
+    int rv=0;
+    this->id=id;  // set id
+    dev->addchan(this);  // not in the constructor: the device threads could call a subclass before it is built
+    if (!openpty) return 0;  // log or route only
+    // allocate pty
+    pty=posix_openpt(O_RDWR|O_NOCTTY|O_NONBLOCK);
+    if (pty==-1) return -1;
+    grantpt(pty);
+    unlockpt(pty);
+    if ((rv=prepfhandle(pty,0))) perror("PTY set attribute");
+    // set link if requested
+    if (link)
+      {
+	// just in case
+	unlink(link);  // force creation
+	if (symlink(ptsname(pty),link))
+	  {
+	    perror(link);
+	    link=NULL;  // on error don't try to delete later
+	  }
+      }
+    return rv;
+  }
+
+// Write to our pty (it is nonblocking) and return how many bytes went
+// If it is full we wait for room once, for up to PTYWAIT_MS, and not at all while it stays
+// full (nobody is reading it), so a stuck pty can't hold up the receive thread
+int ttychan::ptywritev(struct iovec *iov, int cnt)
+{
+  int total=0, left=0, i;
+  bool waited=false;
+  if (pty<0) return 0;
+  for (i=0;i<cnt;i++) left+=iov[i].iov_len;
+  while (left>0)
+    {
+      int rv=writev(pty,iov,cnt);
+      if (rv>0)
+	{
+	  total+=rv;
+	  left-=rv;
+	  // step over what went
+	  for (;cnt>0 && rv>=(int)iov->iov_len;cnt--) rv-=(iov++)->iov_len;
+	  if (cnt>0)
+	    {
+	      iov->iov_base=(char *)iov->iov_base+rv;
+	      iov->iov_len-=rv;
+	    }
+	  continue;
+	}
+      if (rv<0 && errno==EINTR) continue;
+      if (rv<0 && errno!=EAGAIN)
+	{
+	  perror("Write 2");
+	  break;
+	}
+      if (waited || ptyfull) break;
+      struct pollfd pfd;
+      pfd.fd=pty;
+      pfd.events=POLLOUT;
+      waited=true;
+      if (poll(&pfd,1,PTYWAIT_MS)<=0 || !(pfd.revents&POLLOUT)) break;
+    }
+  ptyfull=left>0;
+  return total;
+}
+
+int ttychan::ptywrite(const void *buf, int n)
+{
+  struct iovec iov;
+  iov.iov_base=(void *)buf;
+  iov.iov_len=n;
+  return ptywritev(&iov,1);
+}
+
+// Send what is waiting in tail (receive thread); true when there is nothing left
+bool ttychan::flushtail(void)
+{
+  if (!taillen) return true;
+  int k=ptywrite(tail+tailoff,taillen);
+  tailoff+=k;
+  taillen-=k;
+  if (taillen) return false;
+  dev->tails--;
+  returncredit(tailcredit);  // it is all in the pty now
+  tailcredit=0;
+  return true;
+}
+
+// Add what is left of iov after its first skip bytes to tail
+void ttychan::hold(const struct iovec *iov, int cnt, int skip)
+{
+  int i, size=taillen-skip;
+  for (i=0;i<cnt;i++) size+=iov[i].iov_len;
+  if (size>tailsize)
+    {
+      unsigned char *bigger;
+      tailsize=size>2*tailsize?size:2*tailsize;
+      bigger=new unsigned char[tailsize];
+      memcpy(bigger,tail+tailoff,taillen);
+      delete [] tail;
+      tail=bigger;
+    }
+  else memmove(tail,tail+tailoff,taillen);
+  tailoff=0;
+  if (!taillen) dev->tails++;
+  for (i=0;i<cnt;i++)
+    {
+      int len=iov[i].iov_len;
+      if (skip>=len)
+	{
+	  skip-=len;
+	  continue;
+	}
+      memcpy(tail+taillen,(char *)iov[i].iov_base+skip,len-skip);
+      taillen+=len-skip;
+      skip=0;
+    }
+}
+
+// Send data to the pty after anything already waiting. What doesn't fit waits in tail if it
+// can't be lost: with flow control the other side only gets credit for data that made it to
+// the pty, and a TS_BINARY record (whole) can't be cut short. Returns false if data was dropped
+bool ttychan::ptyput(const struct iovec *iov, int cnt, bool whole)
+{
+  struct iovec v[2];
+  int i, k=0, size=0;
+  if (pty<0) return true;
+  for (i=0;i<cnt;i++)
+    {
+      v[i]=iov[i];   // ptywritev steps through its copy
+      size+=iov[i].iov_len;
+    }
+  if (flushtail()) k=ptywritev(v,cnt);
+  else if (!credits) return false;   // still waiting on the last record, so this one goes
+  if (k==size) return true;
+  if (!credits && (!whole || k==0)) return false;
+  hold(iov,cnt,k);
+  return true;
+}
+
+// Send received data to the pty and log
+void ttychan::emit(const void *buf, int n)
+{
+  struct iovec iov;
+  iov.iov_base=(void *)buf;
+  iov.iov_len=n;
+  ptyput(&iov,1,false);
+  if (log) log->write(buf,n);
+}
+
+// n received bytes have been output (and maybe some of it waits in tail), so the
+// other side can have their credit back once all of it is in the pty
+void ttychan::delivered(int n)
+{
+  if (taillen) tailcredit+=n;
+  else returncredit(n);
+}
+
+// Send a run of received data to the pty (or route), adding timestamps if asked
+void ttychan::deliver(const unsigned char *buf, int n, const struct timespec &ts)
+{
+  if (n<=0) return;
+  if (route)
+    {
+      // the other device gives our credit back once it sends the data
+      route->dev->forward(route,buf,n);
+      if (log) log->write(buf,n);
+      return;
+    }
+  output(buf,n,ts);
+  delivered(n);  // the pty is our buffer, so we can take more once it is there
+}
+
+// Send data to the pty and log in our timestamp mode
+void ttychan::output(const unsigned char *buf, int n, const struct timespec &ts)
+{
+  if (tsmode==TS_BINARY)
+    {
+      ttytsrec rec;
+      struct iovec iov[2];
+      rec.ns=(uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+      rec.len=n;
+      if (log)
+	{
+	  log->write(&rec,sizeof(rec));
+	  log->write(buf,n);
+	}
+      // A record goes to the pty whole or not at all, or the reader would lose its place.
+      // If only the front of one fits, the rest waits in tail and (without flow control)
+      // the records after it are dropped until it is out
+      iov[0].iov_base=&rec;
+      iov[0].iov_len=sizeof(rec);
+      iov[1].iov_base=(void *)buf;
+      iov[1].iov_len=n;
+      if (!ptyput(iov,2,true)) recdrops++;
+      return;
+    }
+  if (tsmode!=TS_TEXT)
+    {
+      emit(buf,n);
+      return;
+    }
+  // text mode: prefix each line, but write whole lines at a time
+  char prefix[32];
+  int plen=snprintf(prefix,sizeof(prefix),"[%ld.%06ld] ",(long)ts.tv_sec,ts.tv_nsec/1000L);
+  while (n>0)
+    {
+      const unsigned char *eol=(const unsigned char *)memchr(buf,'\n',n);
+      int len=eol?(eol-buf)+1:n;
+      if (bol) emit(prefix,plen);
+      emit(buf,len);
+      bol=eol!=NULL;
+      buf+=len;
+      n-=len;
+    }
+}
+
+// Write everything to the tty (it is nonblocking)
+void ttydev::ttywrite(const void *buf, int n)
+{
+  const char *p=(const char *)buf;
+  while (n>0)
+    {
+      int rv=write(tty,p,n);
+      if (rv>0)
+	{
+	  p+=rv;
+	  n-=rv;
+	  continue;
+	}
+      if (rv<0 && errno!=EAGAIN && errno!=EINTR)
+	{
+	  perror("Write error");
+	  return;
+	}
+      struct pollfd pfd;
+      pfd.fd=tty;
+      pfd.events=POLLOUT;
+      poll(&pfd,1,100);
+    }
+}
+
+// Kick the write thread out of poll
+void ttydev::wakewriter(void)
+{
+  char c=0;
+  if (write(wakefd[1],&c,1)<0) return;  // if the pipe is full it is awake anyway
+}
+
+// Escape data for a channel, switching channels if needed, and write it in one go (txmtx held)
+void ttydev::send(ttychan *ch, const unsigned char *buf, int n)
+{
+  unsigned char out[2048+2];
+  while (n>0)
+    {
+      int o=0;
+      // if we are changing channels, send the codes
+      if (ch->id!=coutput)
+	{
+	  out[o++]=0xFF;
+	  out[o++]=ch->id;
+	  coutput=ch->id;  // remember for next time
+	}
+      // send data
+      for (;n>0 && o<(int)sizeof(out)-2;n--)
+	{
+	  out[o++]=*buf;
+	  if (*buf++==0xFF) out[o++]=0xFE;  // handle escaped ff
+	}
+      ttywrite(out,o);
+    }
+}
+
+// Send what our credit allows now and put what fits of the rest in the channel for the write thread
+int ttydev::queuelocked(ttychan *dst, const unsigned char *buf, int n, int *now)
+{
+  int k=n;
+  *now=0;
+  if (dst->rqlen==0)  // keep things in order
+    {
+      if (dst->txflow && dst->txcredit<k) k=dst->txcredit;
+      if (k>0)
+	{
+	  if (dst->txflow) dst->txcredit-=k;
+	  send(dst,buf,k);
+	  *now=k;
+	}
+    }
+  return *now+enqueue(dst,buf+*now,n-*now);
+}
+
+// Put what fits in the channel and wake the write thread (txmtx held)
+int ttydev::enqueue(ttychan *dst, const unsigned char *buf, int n)
+{
+  int room=ttychan::RQSIZE-dst->rqlen, taken;
+  if (n>room) n=room;
+  if (n<=0) return 0;
+  for (taken=n;n>0;n--)
+    dst->rq[(dst->rqhead+dst->rqlen++)%ttychan::RQSIZE]=*buf++;
+  wakewriter();
+  return taken;
+}
+
+// Data received on another device for one of our channels
+// It runs on that device's receive thread, so it only queues the data (a write to our tty
+// could block it); our write thread sends it and gives the source its credit back then
+void ttydev::forward(ttychan *dst, const unsigned char *buf, int n)
+{
+  int k;
+  pthread_mutex_lock(&txmtx);
+  k=enqueue(dst,buf,n);
+  if (k<n)
+    {
+      // only happens without flow control on the source
+      dst->routedrops+=n-k;
+      dst->route->returncredit(n-k);
+    }
+  pthread_mutex_unlock(&txmtx);
+}
+
+// Queue data to send on this channel (txmtx held)
+int ttychan::requeue(const void *buf, int n)
+{
+  int now;
+  if (!rq) rq=new unsigned char[RQSIZE];
+  return dev->queuelocked(this,(const unsigned char *)buf,n,&now);
+}
+
+// We have handed n bytes on, so the other side can send that many more
+void ttychan::returncredit(int n)
+{
+  int old;
+  if (!credits) return;
+  old=rxowed.fetch_add(n);
+  if (old<rxwindow()/2 && old+n>=rxwindow()/2) dev->wakewriter();  // time to send them
+}
+
+// Send the credit we owe for this channel (write thread only, txmtx held)
+void ttychan::sendcredit(void)
+{
+  unsigned char cc[64];
+  int n=rxowed.exchange(0);
+  while (n>0)
+    {
+      int o=0;
+      while (n>0 && o<(int)sizeof(cc))
+	{
+	  int g=n>254?254:n;   // FF would look like an escape
+	  cc[o++]=0xFF;
+	  cc[o++]=0xFC;
+	  cc[o++]=id;
+	  cc[o++]=g;
+	  n-=g;
+	}
+      dev->ttywrite(cc,o);
+    }
+}
+
+// This is the receive thread from real tty
+// We read as much as we can at once, decode it in place, and hand
+// each channel's run to deliver() with the time the chunk arrived
+void *ttydev::rthread(void *arg)
+{
+  ttydev *dev=(ttydev *)arg;
+  ttychan *current;
+  int state=0; // 0 = normal, 1 = escaped, 2 = credit channel next, 3 = credit count next
+  int synced=0;
+  int creditid=0;
+  unsigned char buf[4096];
+  struct pollfd pfd;
+  pfd.fd=dev->tty;
+  pfd.events=POLLIN;
+  while (1)
+    {
+      int i,n,out,run;
+      struct timespec ts;
+      pthread_rwlock_rdlock(&dev->chlock);
+      if (dev->tails)  // records waiting for room in a pty
+	for (ttychan *ch=dev->chanhead;ch;ch=ch->next) ch->flushtail();
+      n=dev->chanhead!=NULL;
+      pthread_rwlock_unlock(&dev->chlock);
+      if (!n || poll(&pfd,1,dev->tails?ttychan::PTYWAIT_MS:-1)<=0) continue;  // wait until someone is listening
+      n=read(dev->tty,buf,sizeof(buf));
+      if (n<=0) continue;
+      clock_gettime(CLOCK_MONOTONIC,&ts);  // one stamp per chunk
+      pthread_rwlock_rdlock(&dev->chlock);
+      if (!dev->rxcur) dev->rxcur=dev->chanhead;   // first time, or our channel went away
+      current=dev->rxcur;
+      if (!current)
+	{
+	  pthread_rwlock_unlock(&dev->chlock);
+	  continue;
+	}
+      out=run=0;   // decoded data is written back into buf[run..out)
+      for (i=0;i<n;i++)
+	{
+	  int c=buf[i];
+	  // need to determine if this is a switch
+	  if (c==0xFF)
+	    {
+	      state=1;
+	      continue;
+	    }
+	  if (state==2)  // FF FC NN: remember NN
+	    {
+	      creditid=c;
+	      state=3;
+	      continue;
+	    }
+	  if (state==3)  // FF FC NN CC: we may send CC more bytes to NN
+	    {
+	      ttychan *ch=dev->find(creditid);
+	      if (ch)
+		{
+		  ch->txcredit+=c;
+		  ch->txflow=true;
+		  dev->wakewriter();
+		}
+	      state=0;
+	      continue;
+	    }
+	  if (state==1 && ttychan::credits && c==0xFC)
+	    {
+	      state=2;
+	      continue;
+	    }
+	  if (state==1 &&c<(ttychan::credits?0xFC:ttychan::v2proto?0xFD:0xFE))  //(c!=0xFE && (c!=0xFD||v2proto==0)))
+	    {
+	      ttychan *ch;
+	      state=0;
+	      if (current->id==c && synced)
+		{
+		  continue;  // we are alredy on this channel so nevermind
+		}
+	      // we need to change channels here to id c
+	      for (ch=dev->chanhead;ch;ch=ch->next)
+		{
+		  if (ch->id==c)
+		    {
+		      current->deliver(buf+run,out-run,ts);  // flush old channel
+		      run=out;
+		      current=dev->rxcur=ch;
+		      dev->cinput=current->id;
+		      synced=1;
+		      break; // break out of for loop
+		    }
+		}
+	      // here we either broke out of the for loop or we fell out in which case nothing happens and we eat the escape
+	      continue;
+	    }
+	  if (state==1 && c== 0xFE)
+	    {
+	      state=0;
+	      c=0xFF;
+	    }
+	  if (state==1 && c==0xFD)  // can't get here if v2proto==0
+	    {
+	      // handle request for response to current (the write thread owns the tty)
+	      dev->syncreq=true;
+	      dev->wakewriter();
+	      state=0;  // eat escape either way
+	      continue;
+	    }
+	  if (ttychan::sync && !synced) continue;  // don't do anything until we get a start sync
+	  buf[out++]=c;
+	}
+      current->deliver(buf+run,out-run,ts);
+      pthread_rwlock_unlock(&dev->chlock);
+    }
+  return NULL;
+}
+
+// Thread that manages writes to real tty
+// Reads what each pty has (up to our credit), escapes it, and writes it in one go
+// Also sends data routed to us that had to wait for credit
+void *ttydev::wthread(void *arg)
+{
+  ttydev *dev=(ttydev *)arg;
+  ttychan *current;
+  unsigned char in[1024];
+  struct pollfd pfd[256];
+  struct timespec probed={0,0};
+  while (1)
+    {
+      int np=0, sent=0;
+      struct timespec now;
+      // A pty with nobody on the other end reports hangup all the time, so poll would never
+      // wait. Leave those out, and look at them again every HUPCHECK_MS to see if somebody came
+      clock_gettime(CLOCK_MONOTONIC,&now);
+      pthread_rwlock_rdlock(&dev->chlock);
+      if ((now.tv_sec-probed.tv_sec)*1000+(now.tv_nsec-probed.tv_nsec)/1000000>=HUPCHECK_MS)
+	{
+	  for (current=dev->chanhead;current;current=current->next) current->hungup=false;
+	  probed=now;
+	}
+      pthread_mutex_lock(&dev->txmtx);
+      if (dev->syncreq.exchange(false) && dev->coutput!=-1)
+	{
+	  in[0]=0xFF;
+	  in[1]=dev->coutput;
+	  dev->ttywrite(in,2);
+	}
+      pthread_mutex_unlock(&dev->txmtx);
+      for (current=dev->chanhead;current;current=current->next)
+	{
+	  int n,max=sizeof(in);
+	  pthread_mutex_lock(&dev->txmtx);
+	  if (ttychan::credits && current->rxowed>=current->rxwindow()/2) current->sendcredit();
+	  if (current->txflow && current->txcredit<max) max=current->txcredit;
+	  if (max>0 && current->rqlen)   // routed data, or data waiting for credit
+	    {
+	      n=current->rqlen;   // all of it that credit allows (it isn't limited by in)
+	      if (current->txflow && current->txcredit<n) n=current->txcredit;
+	      if (n>(int)(ttychan::RQSIZE-current->rqhead)) n=ttychan::RQSIZE-current->rqhead;
+	      if (current->txflow) current->txcredit-=n;
+	      dev->send(current,current->rq+current->rqhead,n);
+	      current->rqhead=(current->rqhead+n)%ttychan::RQSIZE;
+	      current->rqlen-=n;
+	      current->sent(n);
+	      sent+=n;
+	      max=0;
+	    }
+	  pthread_mutex_unlock(&dev->txmtx);
+	  if (current->pty<0 || max<=0 || current->hungup) continue;  // log/route only, wait for credit, or nobody there
+	  if (np<255)
+	    {
+	      pfd[np].fd=current->pty;
+	      pfd[np++].events=POLLIN;
+	    }
+	  n=read(current->pty,in,max);  // need to be nonblock!
+	  if (n<=0) continue; // could be no characters or no connection to pty
+	  pthread_mutex_lock(&dev->txmtx);
+	  if (current->txflow) current->txcredit-=n;
+	  dev->send(current,in,n);
+	  pthread_mutex_unlock(&dev->txmtx);
+	  sent+=n;
+	}
+      pthread_rwlock_unlock(&dev->chlock);
+      if (sent) continue;
+      // nothing to do, so wait for a pty, new credit, or a request from the read thread
+      pfd[np].fd=dev->wakefd[0];
+      pfd[np].events=POLLIN;
+      if (poll(pfd,np+1,HUPCHECK_MS)>0)
+	{
+	  char junk[64];
+	  int i;
+	  while (read(dev->wakefd[0],junk,sizeof(junk))>0);
+	  // the channels may have changed while we waited, so find them again by pty
+	  pthread_rwlock_rdlock(&dev->chlock);
+	  for (i=0;i<np;i++)
+	    if ((pfd[i].revents&POLLHUP) && !(pfd[i].revents&POLLIN))
+	      for (current=dev->chanhead;current;current=current->next)
+		if (current->pty==pfd[i].fd) current->hungup=true;
+	  pthread_rwlock_unlock(&dev->chlock);
+	}
+    }
+  return NULL;
+}
+
+void ttydev::muxsync(void)
+{
+  char cc[4];
+  pthread_mutex_lock(&txmtx);
+  cc[2]=cc[0]='\xff';
+  cc[1]='\xfd';
+  cc[3]=coutput;
+  ttywrite(cc,4);
+  pthread_mutex_unlock(&txmtx);
+}
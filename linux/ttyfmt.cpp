@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Text from binary log records (see ttyfmt.h and MuxLog.h on the device)
+
+#include "ttyfmt.h"
+
+ttyfmt::ttyfmt()
+{
+  table=NULL;
+  size=0;
+}
+
+ttyfmt::~ttyfmt()
+{
+  free(table);
+}
+
+int ttyfmt::load(const char *path)
+{
+  struct stat st;
+  int fd=open(path,O_RDONLY);
+  if (fd<0) return -1;
+  if (fstat(fd,&st) || st.st_size>65536)
+    {
+      close(fd);
+      return -1;
+    }
+  free(table);
+  table=(char *)malloc(st.st_size+1);
+  size=read(fd,table,st.st_size)==st.st_size?st.st_size:0;
+  table[size]='\0';  // so the last string always ends
+  close(fd);
+  return size?0:-1;
+}
+
+// an id has to be the start of a string
+bool ttyfmt::knownid(unsigned id)
+{
+  return id<size && (!id || !table[id-1]);
+}
+
+// take a varint argument (false if the record is too short)
+static bool takevar(const unsigned char *&p, const unsigned char *end, uint64_t *v)
+{
+  *v=0;
+  for (int shift=0;p<end;shift+=7)
+    {
+      if (shift<64) *v|=(uint64_t)(*p&0x7f)<<shift;
+      if (!(*p++&0x80)) return true;
+    }
+  return false;
+}
+
+// snprintf's length, but only what fit
+static int clip(int n, int size)
+{
+  return n<size?n:size-1;
+}
+
+int ttyfmt::format(const unsigned char *rec, int len, char *out, int outsize, bool *valid)
+{
+  const unsigned char *p=rec+2, *end=rec+len;
+  unsigned id;
+  int olen=0;
+  const char *f;
+  if (valid) *valid=false;
+  if (outsize<=0) return 0;
+  if (len<2) return clip(snprintf(out,outsize,"<bad log record>\n"),outsize);
+  id=rec[0]|(rec[1]<<8);
+  if (!knownid(id))
+    return clip(snprintf(out,outsize,"<bad log id %u>\n",id),outsize);
+  f=table+id;
+  while (*f && olen<outsize-1)
+    {
+      char spec[80], conv;
+      int sl=1, argsize=4, k;
+      uint64_t v;
+      if (*f!='%' || f[1]=='%')
+	{
+	  out[olen++]=*f;
+	  f+=*f=='%'?2:1;
+	  continue;
+	}
+      // rebuild the conversion with our own length modifier and any * filled in
+      spec[0]='%';
+      f++;
+      while (*f && strchr("-+ #0",*f) && sl<8) spec[sl++]=*f++;
+      for (int pass=0;pass<2;pass++)
+	{
+	  if (pass && *f=='.') spec[sl++]=*f++;
+	  else if (pass) break;
+	  if (*f=='*')
+	    {
+	      if (!takevar(p,end,&v)) goto shortrec;
+	      sl+=snprintf(spec+sl,12,"%d",(int32_t)v);
+	      f++;
+	    }
+	  else while (*f>='0' && *f<='9' && sl<40) spec[sl++]=*f++;
+	}
+      while (*f && strchr("hljztLq",*f))
+	{
+	  if (*f=='j' || *f=='q' || (*f=='l' && f[1]=='l')) argsize=8;
+	  f+=(*f=='l' && f[1]=='l')?2:1;
+	}
+      conv=*f;
+      if (!conv) break;
+      f++;
+      k=outsize-olen;
+      switch (conv)
+	{
+	case 'd':
+	case 'i':
+	  if (!takevar(p,end,&v)) goto shortrec;
+	  if (argsize==4) v=(int64_t)(int32_t)v;
+	  strcpy(spec+sl,"lld");
+	  k=snprintf(out+olen,k,spec,(long long)v);
+	  break;
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+	  if (!takevar(p,end,&v)) goto shortrec;
+	  if (argsize==4) v=(uint32_t)v;
+	  spec[sl++]='l';
+	  spec[sl++]='l';
+	  spec[sl++]=conv;
+	  spec[sl]='\0';
+	  k=snprintf(out+olen,k,spec,(unsigned long long)v);
+	  break;
+	case 'c':
+	  if (!takevar(p,end,&v)) goto shortrec;
+	  strcpy(spec+sl,"c");
+	  k=snprintf(out+olen,k,spec,(int)v);
+	  break;
+	case 'p':
+	  if (!takevar(p,end,&v)) goto shortrec;
+	  strcpy(spec+sl,"#lx");
+	  k=snprintf(out+olen,k,spec,(unsigned long)v);
+	  break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+	  {
+	    uint32_t u;
+	    float fv;
+	    if (end-p<4) goto shortrec;
+	    u=p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+	    p+=4;
+	    memcpy(&fv,&u,4);
+	    spec[sl++]=conv;
+	    spec[sl]='\0';
+	    k=snprintf(out+olen,k,spec,(double)fv);
+	  }
+	  break;
+	case 's':
+	  {
+	    char str[256];
+	    int n;
+	    if (p>=end || end-p-1<*p) goto shortrec;
+	    n=*p++;
+	    memcpy(str,p,n);
+	    str[n]='\0';
+	    p+=n;
+	    strcpy(spec+sl,"s");
+	    k=snprintf(out+olen,k,spec,str);
+	  }
+	  break;
+	default:  // %n or something we don't know: takes no argument
+	  k=0;
+	  break;
+	}
+      olen+=k<outsize-olen?k:outsize-olen-1;
+    }
+  out[olen]='\0';
+  // bytes left over mean this wasn't a record we know (text that didn't fit still counts)
+  if (valid) *valid=p==end || olen>=outsize-1;
+  return olen;
+ shortrec:
+  // the device leaves off arguments only when the record is full (a varint is at most 10 bytes)
+  if (valid) *valid=len>=255-10;
+  return olen+clip(snprintf(out+olen,outsize-olen,"<short log record>\n"),outsize-olen);
+}
+
+ttyfmtchan::ttyfmtchan(ttydev *dev, ttyfmt *fmt) : ttychan(dev)
+{
+  this->fmt=fmt;
+  reclen=0;
+  records=0;
+  skipped=0;
+  insync=true;
+}
+
+// Put records together (they can be split across reads) and pass the text on
+// Records have no marker to find the next one by, so if bytes go missing (say, the device
+// reset, or a receive buffer overran) the length byte we read is really something else.
+// A record that doesn't decode (bad id or bytes left over) makes us drop one byte and try
+// again with the next as the length, until records decode again
+void ttyfmtchan::deliver(const unsigned char *buf, int n, const struct timespec &ts)
+{
+  char text[8192];
+  int tlen=0;
+  if (n<=0) return;
+  if (route)
+    {
+      ttychan::deliver(buf,n,ts);  // routes get the records as they are
+      return;
+    }
+  while (n>0)
+    {
+      int want=sizeof(rec)-reclen, used=0;
+      if (want>n) want=n;
+      memcpy(rec+reclen,buf,want);
+      reclen+=want;
+      buf+=want;
+      n-=want;
+      // every whole record we have (or start of one with an id we don't know, so a
+      // garbage length byte doesn't keep us waiting for data that belongs to later records)
+      while (reclen-used>0 && (reclen-used>=rec[used]+1 ||
+			       (reclen-used>=3 && !fmt->knownid(rec[used+1]|(rec[used+2]<<8)))))
+	{
+	  char one[1024];
+	  bool valid=false;
+	  int olen=0;
+	  if (reclen-used>=rec[used]+1) olen=fmt->format(rec+used+1,rec[used],one,sizeof(one),&valid);
+	  if (!valid)
+	    {
+	      if (insync)
+		{
+		  olen=snprintf(one,sizeof(one),"<lost log record sync>\n");
+		  memcpy(text+tlen,one,olen);
+		  tlen+=olen;
+		}
+	      insync=false;
+	      skipped++;
+	      used++;
+	    }
+	  else
+	    {
+	      insync=true;
+	      records++;
+	      memcpy(text+tlen,one,olen);
+	      tlen+=olen;
+	      used+=rec[used]+1;
+	    }
+	  if (tlen>(int)sizeof(text)-(int)sizeof(one))
+	    {
+	      output((unsigned char *)text,tlen,ts);
+	      tlen=0;
+	    }
+	}
+      memmove(rec,rec+used,reclen-used);
+      reclen-=used;   // what's left is the start of a record
+    }
+  if (tlen) output((unsigned char *)text,tlen,ts);
+  delivered(n);
+}
@@ -0,0 +1,56 @@
+#ifndef __TTYFMT_H
+#define __TTYFMT_H
+
+/*
+Binary log records (MUXLOG in the device code) turned back into text.
+
+The device sends len id(2) args... where id is the offset of the printf format in the
+firmware's muxlog_fmt section. Pull that section out of the build with
+
+   arm-none-eabi-objcopy -O binary -j muxlog_fmt firmware.elf muxlog.fmt
+
+and load the file here. Integer arguments (and %c, %p, and * widths) are varints, 7 bits
+a byte with the low bits first. Without ll or j they are taken as 32 bits, as on the device.
+Floats are 4 byte little endian floats and %s is a length byte followed by the characters.
+
+If bytes go missing, ttyfmtchan skips ahead a byte at a time until records decode again.
+*/
+
+#include "ttymux.h"
+
+class ttyfmt
+{
+protected:
+  char *table;     // the format strings, each ends with a 0
+  unsigned size;
+public:
+  ttyfmt();
+  ~ttyfmt();
+  // read a table made by objcopy (0 if OK)
+  int load(const char *path);
+  unsigned getSize(void) { return size; }
+  // is id the start of a format?
+  bool knownid(unsigned id);
+  // expand a record (id and arguments, no length byte) into out; returns the text length
+  // *valid is false if it can't be a record from this table (bad id or bytes left over)
+  int format(const unsigned char *rec, int len, char *out, int outsize, bool *valid=NULL);
+};
+
+// A vtty that receives binary log records and hands text to the pty and log
+class ttyfmtchan : public ttychan
+{
+protected:
+  ttyfmt *fmt;
+  unsigned char rec[512];  // received bytes not decoded yet (rec[0] is a record's length)
+  int reclen;
+  unsigned long records;
+  unsigned long skipped;   // bytes dropped looking for the next record
+  bool insync;
+  void deliver(const unsigned char *buf, int n, const struct timespec &ts) override;
+public:
+  ttyfmtchan(ttydev *dev, ttyfmt *fmt);
+  unsigned long getRecords(void) { return records; }
+  unsigned long getSkipped(void) { return skipped; }
+};
+
+#endif
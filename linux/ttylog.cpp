@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <signal.h>
+#include <time.h>
+
+// Asynchronous log files for ttymux (see ttylog.h)
+
+#include "ttylog.h"
+
+ttylog *ttylog::loghead=NULL;
+pthread_t ttylog::thread=(pthread_t)NULL;
+pthread_mutex_t ttylog::mtx=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ttylog::cond=PTHREAD_COND_INITIALIZER;
+pthread_cond_t ttylog::flushed=PTHREAD_COND_INITIALIZER;
+char *ttylog::queue=NULL;
+unsigned ttylog::qsize=4*1024*1024;  // default queue is 4MB
+unsigned ttylog::qhead=0;
+unsigned ttylog::qtail=0;
+unsigned ttylog::qused=0;
+unsigned long ttylog::dropped=0;
+unsigned long ttylog::reported=0;
+long ttylog::maxsize=0;
+int ttylog::maxage=0;
+bool ttylog::compress=false;
+static bool flushreq=false;  // flushAll wants the writer to empty everything
+
+ttylog::ttylog(const char *path)
+{
+  this->path=path;
+  fd=-1;
+  buf=new char[BUFSIZE];
+  blen=0;
+  fsize=0;
+  opened=0;
+  next=loghead;
+  loghead=this;
+}
+
+// Open (append) the log file
+int ttylog::open(void)
+{
+  fd=::open(path,O_WRONLY|O_CREAT|O_APPEND,0644);
+  if (fd<0)
+    {
+      perror(path);
+      return -1;
+    }
+  fsize=lseek(fd,0,SEEK_END);
+  opened=time(NULL);
+  return 0;
+}
+
+// Start the writer thread
+int ttylog::run(void)
+{
+  ttylog *p;
+  if (thread) return 2; // only once
+  queue=new char[qsize];
+  for (p=loghead;p;p=p->next) p->open();
+  if (compress) signal(SIGCHLD,SIG_IGN);  // don't leave zombie gzips around
+  return pthread_create(&thread,NULL,wthread,NULL);
+}
+
+// Copy into the queue ring (caller holds mtx and checked space)
+void ttylog::put(const void *data, unsigned len)
+{
+  const char *p=(const char *)data;
+  unsigned n=qsize-qtail;
+  if (n>len) n=len;
+  memcpy(queue+qtail,p,n);
+  memcpy(queue,p+n,len-n);
+  qtail=(qtail+len)%qsize;
+  qused+=len;
+}
+
+// Copy out of the queue ring (caller holds mtx)
+void ttylog::get(void *data, unsigned len)
+{
+  char *p=(char *)data;
+  unsigned n=qsize-qhead;
+  if (n>len) n=len;
+  memcpy(p,queue+qhead,n);
+  memcpy(p+n,queue,len-n);
+  qhead=(qhead+len)%qsize;
+  qused-=len;
+}
+
+// Queue data for this log. Drops data if the queue is full
+void ttylog::write(const void *data, unsigned len)
+{
+  ttylog *self=this;
+  if (len==0) return;
+  pthread_mutex_lock(&mtx);
+  if (!queue || qused+sizeof(self)+sizeof(len)+len>qsize)
+    dropped+=len;
+  else
+    {
+      bool wake=qused==0;  // writer only sleeps when empty
+      put(&self,sizeof(self));
+      put(&len,sizeof(len));
+      put(data,len);
+      if (wake) pthread_cond_signal(&cond);
+    }
+  pthread_mutex_unlock(&mtx);
+}
+
+// Write our buffer to the file (writer thread only)
+void ttylog::flush(void)
+{
+  unsigned off=0;
+  while (fd>=0 && off<blen)
+    {
+      int rv=::write(fd,buf+off,blen-off);
+      if (rv<0)
+	{
+	  if (errno==EINTR) continue;
+	  perror(path);
+	  break;
+	}
+      off+=rv;
+      fsize+=rv;
+    }
+  blen=0;
+  if (maxsize && fsize>=maxsize) rotate();
+}
+
+// Close the current file, rename it with a time stamp, and start a new one
+void ttylog::rotate(void)
+{
+  char newname[4096];
+  char stamp[32];
+  time_t now=time(NULL);
+  struct tm tmv;
+  if (fd<0) return;
+  close(fd);
+  fd=-1;
+  strftime(stamp,sizeof(stamp),"%Y%m%d-%H%M%S",localtime_r(&now,&tmv));
+  snprintf(newname,sizeof(newname),"%s.%s",path,stamp);
+  if (rename(path,newname)) perror(newname);
+  else if (compress && fork()==0)
+    {
+      execlp("gzip","gzip","-q","-f",newname,(char *)NULL);
+      _exit(1);
+    }
+  open();
+}
+
+// Add to our buffer, writing it out if it fills (writer thread only)
+void ttylog::append(const char *data, unsigned len)
+{
+  while (len)
+    {
+      unsigned n=BUFSIZE-blen;
+      if (n==0)
+	{
+	  flush();
+	  continue;
+	}
+      if (n>len) n=len;
+      memcpy(buf+blen,data,n);
+      blen+=n;
+      data+=n;
+      len-=n;
+    }
+}
+
+// The writer thread. The disk is only touched with the lock released
+void *ttylog::wthread(void *arg)
+{
+  char tmp[BUFSIZE];
+  time_t lastflush=time(NULL);
+  pthread_mutex_lock(&mtx);
+  while (1)
+    {
+      bool req;
+      time_t now;
+      unsigned long drops;
+      ttylog *p;
+      if (qused==0 && !flushreq)
+	{
+	  struct timespec ts;
+	  clock_gettime(CLOCK_REALTIME,&ts);
+	  ts.tv_sec+=1;
+	  pthread_cond_timedwait(&cond,&mtx,&ts);
+	}
+      // take one record at a time and copy it to its log buffer without the lock
+      while (qused)
+	{
+	  ttylog *log;
+	  unsigned len;
+	  get(&log,sizeof(log));
+	  get(&len,sizeof(len));
+	  while (len)
+	    {
+	      unsigned n=len>sizeof(tmp)?sizeof(tmp):len;
+	      get(tmp,n);
+	      len-=n;
+	      pthread_mutex_unlock(&mtx);
+	      log->append(tmp,n);
+	      pthread_mutex_lock(&mtx);
+	    }
+	}
+      req=flushreq;
+      drops=dropped;
+      now=time(NULL);
+      if (!req && now==lastflush) continue;
+      // once a second (or when asked): write partial buffers, rotate old files, report drops
+      pthread_mutex_unlock(&mtx);
+      lastflush=now;
+      for (p=loghead;p;p=p->next)
+	{
+	  if (p->blen) p->flush();
+	  if (maxage && p->fd>=0 && now-p->opened>=maxage) p->rotate();
+	}
+      if (drops!=reported)
+	{
+	  fprintf(stderr,"ttylog: %lu bytes dropped (queue full)\n",drops);
+	  reported=drops;
+	}
+      pthread_mutex_lock(&mtx);
+      if (req)
+	{
+	  flushreq=false;
+	  pthread_cond_broadcast(&flushed);
+	}
+    }
+  return NULL;
+}
+
+// Ask the writer to empty the queue and write everything out, and wait (a while) for it
+void ttylog::flushAll(void)
+{
+  struct timespec ts;
+  if (!thread) return;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  ts.tv_sec+=2;
+  pthread_mutex_lock(&mtx);
+  flushreq=true;
+  pthread_cond_signal(&cond);
+  while (flushreq)
+    if (pthread_cond_timedwait(&flushed,&mtx,&ts)==ETIMEDOUT) break;
+  pthread_mutex_unlock(&mtx);
+}
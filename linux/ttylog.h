@@ -0,0 +1,64 @@
+#ifndef __TTYLOG_H
+#define __TTYLOG_H
+
+/*
+Log files for ttymux channels.
+
+The receive thread calls write() which only copies the data into a bounded queue.
+A single writer thread drains the queue into a large buffer per log file and writes
+that out in big chunks. If the disk stalls, the queue fills up and data is dropped
+(and counted) instead of holding up the serial port.
+
+Logs can rotate when they reach a size or age. The rotated file is renamed to
+name.YYYYMMDD-HHMMSS and, if asked, compressed by running gzip on it in the background.
+*/
+
+#include <pthread.h>
+#include <time.h>
+
+class ttylog
+{
+private:
+  static void *wthread(void *arg);  // the writer thread
+  static void put(const void *buf, unsigned len);  // copy into queue (locked)
+  static void get(void *buf, unsigned len);        // copy out of queue (locked)
+  void append(const char *buf, unsigned len);      // add to our buffer (writer thread)
+  void flush(void);                                // write our buffer out (writer thread)
+  void rotate(void);                               // close, rename, maybe compress, reopen
+  int open(void);
+protected:
+  static ttylog *loghead;   // list of all logs
+  ttylog *next;
+  static pthread_t thread;
+  static pthread_mutex_t mtx;
+  static pthread_cond_t cond;      // wakes the writer
+  static pthread_cond_t flushed;   // the writer finished a flushAll
+  static char *queue;       // the queue is a byte ring of (ttylog *, length, data) records
+  static unsigned qsize, qhead, qtail, qused;
+  static unsigned long dropped;  // bytes we could not queue
+  static unsigned long reported; // drop count last time we complained
+  static long maxsize;      // rotate when file gets this big (0=never)
+  static int maxage;        // rotate when file is this many seconds old (0=never)
+  static bool compress;     // gzip rotated files
+  const char *path;         // log file name
+  int fd;
+  char *buf;                // write buffer
+  unsigned blen;
+  long fsize;               // bytes in current file
+  time_t opened;            // when current file was opened
+public:
+  ttylog(const char *path);
+  // queue data for the log (never blocks on the disk)
+  void write(const void *data, unsigned len);
+  // start writer thread (call after creating logs)
+  static int run(void);
+  // write out everything queued so far (e.g., on exit)
+  static void flushAll(void);
+  static unsigned long getDropped(void) { return dropped; }
+  static void setRotate(long size, int seconds) { maxsize=size; maxage=seconds; }
+  static void setCompress(bool state=true) { compress=state; }
+  static void setQueueSize(unsigned size) { qsize=size; }  // before run
+  static const unsigned BUFSIZE=65536;  // per log write size
+};
+
+#endif
@@ -1,336 +1,206 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <pthread.h>
-#include <fcntl.h>
 #include <unistd.h>
-#include <termios.h>
-#include <errno.h>
 #include <getopt.h>
 #include <cstring>
 #include <signal.h>
 
 
 // This runs forever until you break
-// Note that creating symlinks doesn't really check much
-// And will delete anything it creates on normal exit
-// So be careful if you run this as root (which you probably shouldn't)
-
-
-// The class maintains a list of all virtual ttys (vttys)
+// The engine is in libttymux (ttychan.cpp); this is just the command line
 
 #include "ttymux.h"
+#include "ttyfmt.h"
+#include "ttytel.h"
 
-int ttychan::tty=-1;   // the real serial port/tty
-ttychan *ttychan::ttyhead=NULL;  // head of the list of ptys
-// the threads that manage the real tty
-pthread_t ttychan::readthread=(pthread_t)NULL;   
-pthread_t ttychan::writethread=(pthread_t)NULL;
-int ttychan::autodelete=0;
-int ttychan::nottysetup=0;
-int ttychan::v2proto=1;
-int ttychan::coutput=0;
-int ttychan::cinput=0;
-bool ttychan::sync=false;
-
-// Clean up on destruct or explicit request
-void ttychan::cleanup(void)
+// generic error and help messages
+static void Xerror(const char *msg, int rc=1)
 {
-  close(pty);
-  if (link && autodelete)
-    {
-      unlink(link);
-    }
+  fprintf(stderr,"%s\n",msg);
+  exit(rc);
 }
 
-// Walk the list and clean up everyone
-void ttychan::cleanupAll(void)
+static void help(void)
 {
-  ttychan *p;
-  for (p=ttyhead;p;p=p->next)
-    {
-      p->cleanup();
-    }
-}
+  Xerror("Usage: ttymux -d -c [dev/]id[:link] [-c [dev/]id[:link]...] serial_port [serial_port...]\n"
+	 "   -c - Set up channel with ID and optional symlink (full path)\n"
+	 "        dev is which serial_port (0 is the first and the default)\n"
+         "   -d - Autodelete symlinks on exit\n"
+	 "   -n - Do not set default terminal attributes on serial_port\n"
+	 "   -s - Don't rececive until you get the first escape code\n"
+	 "   -1 - Omit protocol v2 extensions (Allow channel 0xFD)\n"
+	 "   -t - Timestamp mode for following -c channels: none, text, or binary\n"
+	 "   -l - Log channel to a file: -l [dev/]id:file (the channel needs no -c)\n"
+	 "   -r - Rotate logs: -r size[k|M][:seconds]\n"
+	 "   -z - gzip rotated logs\n"
+	 "   -f - Credit flow control (channel 0xFC not available): -f or -fwindow\n"
+	 "   -R - Route channels between serial ports: -R dev/id=dev/id\n"
+	 "   -F - Following -c and -l channels carry binary log records: -F table (-F - for none)\n"
+	 "   -T - Following -c and -l channels carry telemetry frames: csv, binary, or none\n"
+	 ,1);
 
-// Destructor -- not always called (e.g., on exit()).
-ttychan::~ttychan()
-{
-  ttychan *b4,*after=next;
-  // find my parent
-  for (b4=ttyhead;b4->next!=this;b4=b4->next);
-  // unlink myself
-  if (b4)
-    {
-      b4->next=after;
-    }
-  cleanup();
-  
 }
 
-
-ttychan::ttychan()
+// Control C handler
+// Only sets a flag: flushing logs and cleaning up aren't safe in a handler, so main does it
+static volatile sig_atomic_t quit=0;
+static void sighandle(int notused)
 {
-  link=NULL;
-  next=ttyhead;
-  ttyhead=this;
-  pty=-1;
+  quit=1;
 }
 
-// Construct with a filename. Again, only once (default after that)
-int ttychan::run(const char *fn)
+// parse [dev/]id and return the id; *rest points past it
+static int parsechan(char *spec, int *dev, char **rest)
 {
-  int ftty=open(fn,O_RDWR|O_NOCTTY|O_SYNC|  O_NONBLOCK);
-  if (ftty<0)
+  long n;
+  char *slash=strchr(spec,'/');
+  char *colon=strchr(spec,':');
+  *dev=0;
+  if (slash && (!colon || slash<colon))
     {
-      perror(fn);
-      return -1;
+      *dev=strtol(spec,NULL,0);
+      spec=slash+1;
     }
-  else
-    return run(ftty);
-}
-
-// user override to tweak handle settings
-// Note type==1 for tty, 0 for vttys
-void ttychan::adjustfile(int type,struct termios *info)
-{
-  return;
+  n=strtol(spec,rest,0);
+  if (*rest==spec || n<0 || n>254) Xerror("Channel ID must be 0-254");
+  if (*dev<0 || *dev>15) Xerror("Device must be 0-15");
+  return n;
 }
 
-// Prep a file handle
-int ttychan::prepfhandle(int handle)
+// make a channel that decodes telemetry or log records if asked
+static ttychan *newchan(ttydev *dev, ttyfmt *fmt, int telmode)
 {
-  struct termios info;
-  tcgetattr(handle,&info);
-  if ((handle==tty && nottysetup==0)||handle!=tty)
-      {
-      cfmakeraw(&info);
-      info.c_cflag&=~CRTSCTS;
-      info.c_cflag|=(CLOCAL|CREAD);
-      info.c_cflag&= ~CSIZE;
-      info.c_oflag&=~OPOST;
-      info.c_cc[VTIME]=0;
-      info.c_cc[VMIN]=0;
-      }
-  adjustfile(handle==tty,&info);
-  return tcsetattr(handle,TCSANOW,&info);
-
+  if (telmode) return new ttytelchan(dev,telmode);
+  if (fmt) return new ttyfmtchan(dev,fmt);
+  return new ttychan(dev);
 }
 
-// Run the server. If you haven't already passed a base tty
-// you must do so now
-int ttychan::run(int basetty)
+// find or make a channel with no pty (an existing one keeps its modes; main checks they agree)
+static ttychan *getchan(ttydev *dev, int id, int tsmode, ttyfmt *fmt=NULL, int telmode=ttytelchan::TEL_NONE)
 {
-  int rv=0;
-  if (basetty>0) tty=basetty;
-  if (readthread || writethread) return 2; // don't call me more than once!
-  tcflush(tty,TCIOFLUSH);
-  // this should be in an override and check errors?
-  if (prepfhandle(tty)) perror("TTY set attribute");
-  // check threads and if needed start them up
-  rv=pthread_create(&ttychan::readthread, NULL, ttychan::rthread,NULL);
-  if (rv==0)
-      rv=pthread_create(&ttychan::writethread,NULL,ttychan::wthread,NULL);
-  return rv;
-}
-
-
-// Start a vtty with the given id
-int ttychan::start(int id)
-  {
-    int rv=0;
-    this->id=id;  // set id
-    // allocate pty
-    pty=posix_openpt(O_RDWR|O_NOCTTY|O_NONBLOCK);
-    if (pty==-1) return -1;
-    grantpt(pty);
-    unlockpt(pty);
-    if ((rv=prepfhandle(pty))) perror("PTY set attribute");
-    // set link if requested
-    if (link)
-      {
-	// just in case
-	unlink(link);  // force creation
-	if (symlink(ptsname(pty),link))
-	  {
-	    perror(link);
-	    link=NULL;  // on error don't try to delete later
-	  }
-      }
-    return rv;
-  }
-
-// This is the receive thread from real tty
-void *ttychan::rthread(void *arg)
-{
-  ttychan *current=ttyhead;
-  int state=0; // 0 = normal, 1 = escaped
-  int synced=0;
-  while (1)
+  ttychan *chan=dev->find(id);
+  if (!chan)
     {
-      int c;
-      // get character
-      if (!current) continue;  // wait until someone is listening
-      if (read(tty,&c,1)!=1) continue;
-      // need to determine if this is a switch
-      if (c==0xFF)
-	{
-	  state=1;
-	  continue;
-	}
-      if (state==1 &&c<(v2proto?0xFD:0xFE))  //(c!=0xFE && (c!=0xFD||v2proto==0)))
-	{
-	  ttychan *i;
-	  state=0;
-	  if (current->id==c && synced)
-	    {
-	      continue;  // we are alredy on this channel so nevermind
-	    }
-	  // we need to change channels here to id c
-	  for (i=ttyhead;i;i=i->next)
-	    {
-	      if (i->id==c)
-		{
-		  current=i;
-		  cinput=current->id;
-		  synced=1;
-		  break; // break out of for loop
-		}
-	    }
-	  // here we either broke out of the for loop or we fell out in which case nothing happens and we eat the escape
-	  continue;
-	}
-      if (state==1 && c== 0xFE)
-	{
-	  state=0;
-	  c=0xFF;
-	}
-      if (state==1 && c==0xFD)  // can't get here if v2proto==0
-	{
-	  char cc[2];
-	  if (coutput!=-1)
-	    {
-	      cc[0]='\xff';
-	      cc[1]=coutput;
-	  // handle request for response to current
-	      write(tty,cc,2);
-	    }
-	  state=0;  // eat escape either way
-	  continue;
-	}
-      if (sync && !synced) continue;  // don't do anything until we get a start sync
-      if (current && current->pty>0)
-	{
-	  int rv;
-	  // this is sort of a hack. If the pty is not ready we should retry
-	  // but if it isn't ready for a bunch of times in a row, we eventually kill everything spinning in this loop
-	  // then the transmitter overflows and well... so we set a "resonable number" for retries 
-	  int retrycount=10000;   // if we have a disconnected PTY this eventually gets crazy
-	  do {
-	    rv=write(current->pty,&c,1); 
-	  } while (rv==-1 && errno==EAGAIN && --retrycount);
-	  if (rv<0) perror("Write 2");
-	}
-    }
-  return NULL;
-}
-
-// Thread that manages writes to real tty
-void *ttychan::wthread(void *arg)
-{
-  ttychan *current;
-  int lastid=-1;
-  coutput=-1;  // not really but if you ask now that's what we will answer
-  char cc[2];
-  while (1)
-    {
-      for (current=ttyhead;current;current=current->next)
-	{
-	  int c,n;
-	  usleep(0); // this is not a very good answer but it does work... why???? Should just yield
-	  n=read(current->pty,&c,1);  // need to be nonblock!
-
-	  if (n<=0) continue; // could be no characters or no connection to pty
-	  // if we are changing channels, send the codes
-	  if (current->id!=lastid)
-	    {
-	      char sw[2];
-	      // send escape
-	      sw[0]='\xff';
-	      sw[1]=current->id;
-	      write(tty,sw,2);
-	      lastid=current->id;  // remember for next time
-	      coutput=lastid;
-	    }
-	  // send data
-	  cc[0]=c;
-	  n=1;
-	  if (c=='\xff')
-	    {
-	      cc[1]='\xff';  // handle escaped ff
-	      n=2;
-	    }
-	      
-	  if (write(tty,cc,n)!=n) perror("Write error"); 
-	}
+      chan=newchan(dev,fmt,telmode);
+      chan->setTimestamp(tsmode);
+      chan->start(id,false);
     }
-  return NULL;
-}
-
-void ttychan::muxsync(void)
-{
-  char cc[4];
-  cc[2]=cc[0]='\xff';
-  cc[1]='\xfd';
-  cc[3]=coutput;
-  write(tty,cc,4);
-}
-
-// generic error and help messages
-static void Xerror(const char *msg, int rc=1)
-{
-  fprintf(stderr,"%s\n",msg);
-  exit(rc);
-}     
-
-static void help(void)
-{
-  Xerror("Usage: ttymux -d -c id[:link] [-c id[:link]...] serial_port\n"
-	 "   -c - Set up channel with ID and optional symlink (full path)\n"
-         "   -d - Autodelete symlinks on exit\n"
-	 "   -n - Do not set default terminal attributes on serial_port\n"
-	 "   -s - Don't rececive until you get the first escape code\n"
-	 "   -1 - Omit protocol v2 extensions (Allow channel 0xFD)\n"
-	 ,1);
-
-}
-
-// Control C handler
-static void sighandle(int notused)
-{
-  // clean up on signals
-  fprintf(stderr,"Exiting on signal\n");
-  ttychan::cleanupAll();
-  exit(10);
+  return chan;
 }
 
 // The server
 int main(int argc, char *argv[])
 {
-  FILE *f;
   int opt, nchannels=0,i;
   // small waste of memory, but not much
   unsigned char channels[254];  // id for each channel
+  unsigned char chandevs[254];  // device for each channel
   char *links[254];  // link pointer for each channel
+  int tsmodes[254];  // timestamp mode for each channel
+  int tsmode=ttychan::TS_NONE;
+  ttyfmt *fmts[254];  // log record table for each channel (or NULL)
+  ttyfmt *fmt=NULL;
+  int telmodes[254];  // telemetry decoding for each channel
+  int telmode=ttytelchan::TEL_NONE;
+  int nlogs=0;
+  int credits=0;
+  unsigned char logids[254];  // channel and file for each log
+  unsigned char logdevs[254];
+  char *logfiles[254];
+  int logtsmodes[254];
+  ttyfmt *logfmts[254];
+  int logtelmodes[254];
+  int nroutes=0;
+  unsigned char routes[254][4];  // dev, id, dev, id
+  int ndevs;
+  ttydev *devs[16];
+  sigset_t intmask, waitmask;
   signal(SIGINT,sighandle);  // catch Control+C
+  // Hold SIGINT until main waits for it (threads started later inherit this, so it comes to us)
+  sigemptyset(&intmask);
+  sigaddset(&intmask,SIGINT);
+  sigprocmask(SIG_BLOCK,&intmask,&waitmask);
   // process command line
-  while ((opt=getopt(argc,argv,"dc:hn1s"))!=-1)
+  while ((opt=getopt(argc,argv,"dc:hn1st:l:r:zf::R:F:T:"))!=-1)
     {
       switch (opt)
 	{
 	case 's':
 	  ttychan::setsync();
 	  break;
-	  
+
+	case 'l':
+	  {
+	    char *colon;
+	    int d;
+	    if (nlogs==254) Xerror("Too many logs");
+	    logids[nlogs]=parsechan(optarg,&d,&colon);
+	    if (*colon!=':') Xerror("Log must be -l [dev/]id:file");
+	    logdevs[nlogs]=d;
+	    logtsmodes[nlogs]=tsmode;
+	    logfmts[nlogs]=fmt;
+	    logtelmodes[nlogs]=telmode;
+	    logfiles[nlogs++]=strdup(colon+1);
+	  }
+	  break;
+
+	case 'R':
+	  {
+	    char *rest;
+	    int d;
+	    if (nroutes==254) Xerror("Too many routes");
+	    routes[nroutes][1]=parsechan(optarg,&d,&rest);
+	    routes[nroutes][0]=d;
+	    if (*rest!='=') Xerror("Route must be -R dev/id=dev/id");
+	    routes[nroutes][3]=parsechan(rest+1,&d,&rest);
+	    routes[nroutes++][2]=d;
+	  }
+	  break;
+
+	case 'r':
+	  {
+	    char *end;
+	    long size=strtol(optarg,&end,0);
+	    if (*end=='k'||*end=='K') size*=1024L;
+	    if (*end=='m'||*end=='M') size*=1024L*1024L;
+	    end=strchr(optarg,':');
+	    ttylog::setRotate(size,end?atoi(end+1):0);
+	  }
+	  break;
+
+	case 'f':
+	  if (optarg && atoi(optarg)<2) Xerror("Window must be at least 2");
+	  ttychan::setcredits(true,optarg?atoi(optarg):4096);
+	  credits=1;
+	  break;
+
+	case 'F':
+	  if (strcmp(optarg,"-")==0) fmt=NULL;
+	  else
+	    {
+	      fmt=new ttyfmt();
+	      if (fmt->load(optarg)) Xerror("Can't read format table");
+	    }
+	  break;
+
+	case 'T':
+	  if (*optarg=='n') telmode=ttytelchan::TEL_NONE;
+	  else if (*optarg=='c') telmode=ttytelchan::TEL_CSV;
+	  else if (*optarg=='b') telmode=ttytelchan::TEL_BINARY;
+	  else Xerror("Telemetry mode must be csv, binary, or none");
+	  break;
+
+	case 'z':
+	  ttylog::setCompress();
+	  break;
+
+	case 't':
+	  if (*optarg=='n') tsmode=ttychan::TS_NONE;
+	  else if (*optarg=='t') tsmode=ttychan::TS_TEXT;
+	  else if (*optarg=='b') tsmode=ttychan::TS_BINARY;
+	  else Xerror("Timestamp mode must be none, text, or binary");
+	  break;
+
 	case '1':
 	  ttychan::v2proto=0;  // No version 2 protocol
 	  break;
@@ -342,21 +212,22 @@ int main(int argc, char *argv[])
 	  break;
 	case 'c':
 	  {
-	    long nlong;
-	    int n;
-	    nlong=strtol(optarg,NULL,0);  // get id #
-	    n=nlong;
+	    char *colon;
+	    int d;
+	    if (nchannels==254) Xerror("Too many channels");
+	    channels[nchannels]=parsechan(optarg,&d,&colon);
+	    chandevs[nchannels]=d;
 	    // find link if ther
-	    char *colon=strchr(optarg,':');
-	    if (colon)
+	    if (*colon==':')
 	      {
 		// remember link name (we never free this)
 		links[nchannels]=strdup(colon+1);
 	      }
 	    else
 	      links[nchannels]=NULL;
-	    if (n<0||n>254) Xerror("Channel ID must be 0-254");
-	    channels[nchannels++]=n;
+	    fmts[nchannels]=fmt;
+	    telmodes[nchannels]=telmode;
+	    tsmodes[nchannels++]=tsmode;
 	  }
 	  break;
 	case 'h':
@@ -365,24 +236,65 @@ int main(int argc, char *argv[])
 	}
     }
   // sanity checks
-  if (nchannels==0) Xerror("Must specify at least one channel (-c)",2);
+  if (nchannels==0 && nlogs==0 && nroutes==0) Xerror("Must specify at least one channel (-c, -l, or -R)",2);
   if (optind>=argc) Xerror("Must specify serial port or device",3);
-  // we must have one object and we create it 
-  ttychan chan0;
-  if (chan0.run(argv[optind])) exit(1);   // and start the server
-  if (links[0]) chan0.setLink(links[0]);  // and set its link
-  // now we actually start the vtty
-  if (chan0.start(channels[0])) fprintf(stderr,"Can't open PTY 0\n");
-  printf("Connect %d = %s (%s)\n",channels[0],chan0.getptyname(),links[0]?links[0]:"");  
-  // do 1 to N-1 for the rest
-  for (i=1;i<nchannels;i++)
+  ndevs=argc-optind;
+  if (ndevs>16) Xerror("Too many serial ports",3);
+  if (credits && (memchr(channels,0xFC,nchannels) || memchr(logids,0xFC,nlogs))) Xerror("Channel 0xFC is used for credits (-f)",2);
+  for (i=0;i<nchannels;i++) if (chandevs[i]>=ndevs) Xerror("No such serial port for -c",3);
+  for (i=0;i<nlogs;i++) if (logdevs[i]>=ndevs) Xerror("No such serial port for -l",3);
+  // a channel has one -t, -F and -T mode for its pty and log, so they have to agree
+  for (i=0;i<nlogs;i++)
+    {
+      int j;
+      for (j=0;j<nchannels;j++)
+	if (chandevs[j]==logdevs[i] && channels[j]==logids[i] &&
+	    (tsmodes[j]!=logtsmodes[i] || fmts[j]!=logfmts[i] || telmodes[j]!=logtelmodes[i]))
+	  Xerror("-t, -F and -T for a -l must be the same as for its channel's -c",2);
+      for (j=0;j<i;j++)
+	if (logdevs[j]==logdevs[i] && logids[j]==logids[i]) Xerror("Only one -l for each channel",2);
+    }
+  for (i=0;i<nroutes;i++)
     {
-      ttychan *chan=new ttychan();
+      if (routes[i][0]>=ndevs || routes[i][2]>=ndevs) Xerror("No such serial port for -R",3);
+      if (credits && (routes[i][1]==0xFC || routes[i][3]==0xFC)) Xerror("Channel 0xFC is used for credits (-f)",2);
+    }
+  for (i=0;i<ndevs;i++) devs[i]=new ttydev();
+  // create the vttys first
+  for (i=0;i<nchannels;i++)
+    {
+      ttychan *chan=newchan(devs[chandevs[i]],fmts[i],telmodes[i]);
       if (links[i]) chan->setLink(links[i]);
+      chan->setTimestamp(tsmodes[i]);
       // in theory, we are done with link so we could reclaim that memory
       if (chan->start(channels[i])) fprintf(stderr,"Can't open PTY %d\n",i);
-      printf("Connect %d = %s (%s)\n",channels[i],chan->getptyname(),links[i]?links[i]:"");
+      if (ndevs>1) printf("Connect %d/%d = %s (%s)\n",chandevs[i],channels[i],chan->getptyname(),links[i]?links[i]:"");
+      else printf("Connect %d = %s (%s)\n",channels[i],chan->getptyname(),links[i]?links[i]:"");
+    }
+  // attach logs, making log-only channels as needed
+  for (i=0;i<nlogs;i++)
+    {
+      ttychan *chan=getchan(devs[logdevs[i]],logids[i],logtsmodes[i],logfmts[i],logtelmodes[i]);
+      chan->setLog(new ttylog(logfiles[i]));
+      if (ndevs>1) printf("Log %d/%d = %s\n",logdevs[i],logids[i],logfiles[i]);
+      else printf("Log %d = %s\n",logids[i],logfiles[i]);
     }
-  while (1); 
-  return 0;  // not reached
+  // routes between devices (a routed channel's input goes to the route, not its pty)
+  for (i=0;i<nroutes;i++)
+    {
+      ttychan::connect(getchan(devs[routes[i][0]],routes[i][1],ttychan::TS_NONE),
+		       getchan(devs[routes[i][2]],routes[i][3],ttychan::TS_NONE));
+      printf("Route %d/%d = %d/%d\n",routes[i][0],routes[i][1],routes[i][2],routes[i][3]);
+    }
+  if (nlogs && ttylog::run()) Xerror("Can't start log writer",4);
+  // and start the servers
+  for (i=0;i<ndevs;i++)
+    if (devs[i]->run(argv[optind+i])) exit(1);
+  while (!quit) sigsuspend(&waitmask);
+  // clean up on signals
+  fprintf(stderr,"Exiting on signal\n");
+  ttylog::flushAll();
+  if (ttylog::getDropped()) fprintf(stderr,"Log bytes dropped: %lu\n",ttylog::getDropped());
+  ttydev::cleanupAll();
+  return 10;
 }
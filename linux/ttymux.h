@@ -12,6 +12,14 @@ with an escape code, of course.
 
 FF [FF FF...] FE -> real FF
 FF [FF FF...] NN -> Switch to channel NN (00-FD)
+FF [FF FF...] FD -> Ask the other side to resend its current channel (v2)
+FF [FF FF...] FC NN CC -> Credit: the other side can take CC (1-FE) more data bytes on channel NN (-f only, so channel FC is not available)
+
+Flow control (-f): each side grants the other credits for the bytes it can buffer on each channel.
+Once we get a credit for a channel, we never send more bytes on that channel than we have credit for
+(an escaped FF counts as one byte). Channels we never got a credit for are sent freely, so the other
+side does not have to know about credits. We grant a window of credits for each of our channels at startup
+and give them back once the data has been handed to the pty.
 
 Bytes coming from a PTY (vtty) get sent to the main tty with the escape code to switch if necessary.
 Bytes coming in get routed to the correct vtty based on the last escape
@@ -23,57 +31,188 @@ another escape code occurs.
 
 If this worries you, set up a fake default port and don't use it. Then ensure you periodically assert an escape code.
 
+You can run more than one device (ttydev) at once. A channel on one device can be connected to a channel on another
+(ttychan::connect). Data received on either one is encoded straight onto the other device's tty with no pty in between.
+If the destination is out of credit, up to RQSIZE bytes wait in the destination channel and the source does not get its
+credit back until they are sent, so flow control works end to end.
+
+Timestamps: the receive thread takes one CLOCK_MONOTONIC timestamp per chunk it reads from the tty.
+Each vtty can ask for that time to be passed along (see setTimestamp):
+  TS_NONE   - raw data (default)
+  TS_TEXT   - each line starts with [seconds.microseconds] 
+  TS_BINARY - a stream of ttytsrec headers each followed by len data bytes. A record goes to the pty whole
+              or is dropped (getRecordDrops) if the pty is full, so a reader never loses its place
+
 */
 
-class ttychan
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <sys/uio.h>
+#include "ttylog.h"
+
+// Record header for TS_BINARY mode (host byte order)
+struct ttytsrec
 {
-private:
-  void construct(int basetty);  // private constructor helper
-  static int prepfhandle(int handle);  // prepare handle for I/O
+  uint64_t ns;   // monotonic receive time in nanoseconds
+  uint32_t len;  // number of data bytes following this header
+} __attribute__((packed));
+
+class ttychan;
+
+// One real serial port (device) and the two threads that serve it
+// Each device has its own list of channels (vttys)
+class ttydev
+{
+  friend class ttychan;
 protected:
-  static int tty;   // main tty (serial port)
-  static ttychan *ttyhead;  // first item in list of vttys
-  ttychan *next;    // next vtty
-  // need static read thread/write thread
-  static pthread_t readthread, writethread;  // threads to manage port
-  // the actual thread functions
+  int tty;   // main tty (serial port)
+  ttychan *chanhead;  // first item in list of vttys on this device
+  // The threads hold chlock (shared) while they use the channel list and rxcur, so a channel
+  // can be added or removed (exclusive) while they run
+  pthread_rwlock_t chlock;
+  ttychan *rxcur;     // channel the read thread is delivering to
+  void addchan(ttychan *ch);
+  void removechan(ttychan *ch);
+  ttydev *next;       // next device
+  static ttydev *devhead;  // all devices
+  pthread_t readthread, writethread;  // threads to manage port
+  // the actual thread functions (arg is the device)
   static void *rthread(void *arg);
   static void *wthread(void *arg);
+  int cinput;
+  int coutput;   // what we told the other side we are sending (txmtx)
+  int wakefd[2];        // pipe to wake up the write thread
+  std::atomic<bool> syncreq;  // other side asked for our current channel
+  pthread_mutex_t txmtx;      // our write thread and routes from other devices share the tty
+  int tails;                  // channels with data waiting for room in their pty (receive thread)
+  static const int HUPCHECK_MS=100;  // how often the write thread looks at ptys nobody had open
+  void ttywrite(const void *buf, int n);  // write all to tty
+  void wakewriter(void);
+  // encode data for a channel and write it (txmtx held)
+  void send(ttychan *ch, const unsigned char *buf, int n);
+  // send now what credit allows and queue what fits in the channel (txmtx held)
+  // returns bytes taken and sets *now to how many went out right away
+  int queuelocked(ttychan *dst, const unsigned char *buf, int n, int *now);
+  // queue only: what fits of the data for the write thread (txmtx held, returns bytes taken)
+  int enqueue(ttychan *dst, const unsigned char *buf, int n);
+  // data routed to one of our channels from another device
+  void forward(ttychan *dst, const unsigned char *buf, int n);
+public:
+  ttydev();
+  // start the server for this device (do once)
+  int run(int basetty);
+  int run(const char *fn);
+  // find the vtty with a given id
+  ttychan *find(int id);
+  // get file descriptor for tty
+  int getFD(void) { return tty; }
+  int get_current_input(void) { return cinput; }
+  int get_current_output(void) { return coutput; }
+  // ask the other side to resend its channel
+  void muxsync(void);
+  // clean up all vttys on all devices
+  static void cleanupAll(void);
+};
+
+class ttychan
+{
+  friend class ttydev;
+private:
+  static int prepfhandle(int handle, int type);  // prepare handle for I/O
+protected:
+  ttydev *dev;      // the device we belong to
+  ttychan *next;    // next vtty on the device
   // vtty pty
   int pty;
+  // timestamp mode and line state for TS_TEXT
+  int tsmode;
+  bool bol;
+  // log file if any
+  ttylog *log;
+  // route: received data goes to this channel on another device instead of the pty
+  ttychan *route;
+  // routed (or application) data for us waiting on credit (dev->txmtx)
+  unsigned char *rq;
+  unsigned rqhead, rqlen;
+  static const unsigned RQSIZE=65536;
+  unsigned long routedrops;   // routed bytes dropped because rq was full
+  // write to the pty without blocking for long; returns bytes written
+  int ptywrite(const void *buf, int n);
+  int ptywritev(struct iovec *iov, int cnt);
+  bool ptyfull;     // the last write didn't all fit
+  bool hungup;      // nobody has the pty open, so the write thread doesn't poll it (write thread)
+  static const int PTYWAIT_MS=10;
+  // data waiting for room in the pty (receive thread): the rest of a TS_BINARY record that only
+  // partly fit, or with flow control anything that didn't fit
+  unsigned char *tail;
+  int tailoff, taillen, tailsize;
+  int tailcredit;           // received bytes we owe credit for once tail is out
+  unsigned long recdrops;   // TS_BINARY records dropped because the pty was full
+  bool flushtail(void);
+  void hold(const struct iovec *iov, int cnt, int skip);
+  bool ptyput(const struct iovec *iov, int cnt, bool whole);
+  // flow control state
+  std::atomic<int> txcredit;   // bytes we may send on this channel
+  std::atomic<bool> txflow;    // true once the other side has sent us credits
+  std::atomic<int> rxowed;     // bytes we received but have not granted back yet
+  void returncredit(int n);    // data delivered, so we owe the sender credit
+  void delivered(int n);       // n received bytes were output: credit them now, or once tail is out
+  void sendcredit(void);       // send what we owe (write thread)
+  // send received data to the pty and log
+  void emit(const void *buf, int n);
+  // hand a decoded run of received bytes to this vtty (subclasses can take the data themselves)
+  virtual void deliver(const unsigned char *buf, int n, const struct timespec &ts);
+  // received data for the pty and log, with timestamps if asked
+  void output(const unsigned char *buf, int n, const struct timespec &ts);
+  // n queued bytes went out to the tty (write thread, txmtx held)
+  virtual void sent(int n) { if (route) route->returncredit(n); }
+  // lock our device's transmitter and queue data for it (see ttydev::queuelocked)
+  void txlock(void) { pthread_mutex_lock(&dev->txmtx); }
+  void txunlock(void) { pthread_mutex_unlock(&dev->txmtx); }
+  int requeue(const void *buf, int n);
+  // leave our device; the device threads won't touch us after this (subclasses call it first in their destructor)
+  void detach(void) { dev->removechan(this); }
   // name of symlink if any
   const char *link;
   int id;  // the ID that identifies this vtty
   // this is for subclasses if they just want to modify the termios for the tty (type=1) or ptys (type=0)
   // this runs even if notttysetup is set even on the tty
   static void adjustfile(int type, struct termios *info);
-  static int cinput;
-  static int coutput;
   static bool sync;  // if 1 wait for a channel escape before reading anything
+  static bool credits;  // use credit flow control
+  static int window;    // credits we grant each channel
+  int rxlimit;          // most this channel can hold for the other side (0 for no limit)
+  int rxwindow(void) { return rxlimit && window>rxlimit?rxlimit:window; }   // window, but no more than that
 public:
-  // construct with file name or handle
-  ttychan();
-  ~ttychan();
-  // start the server (do once)
-  static int run(int basetty);
-  static int run(const char *fn);
-
-  // start a vtty with particular id
-  int start(int id);
+  enum { TS_NONE=0, TS_TEXT, TS_BINARY };  // timestamp modes
+  // construct on a device
+  ttychan(ttydev *dev);
+  virtual ~ttychan();
+
+  // start a vtty with particular id (with no pty if you only want to log or route it)
+  int start(int id, bool openpty=true);
   // get pty name
-  const char *getptyname(void) { return ptsname(pty); };
+  const char *getptyname(void) { return pty<0?"no pty":ptsname(pty); };
   // get symlink name or pty name if no link
   const char *getlink(void) { return link?link:getptyname(); }
-  // get file descriptor for tty
-  int getFD(void) { return tty; }
+  int getid(void) { return id; }
+  ttydev *getdev(void) { return dev; }
   // set link name
   void setLink(const char *link) { this->link=link; }
+  // set timestamp mode (TS_NONE, TS_TEXT, TS_BINARY)
+  void setTimestamp(int mode) { tsmode=mode; }
+  // log received data to a file
+  void setLog(ttylog *log) { this->log=log; }
+  // connect two channels (normally on different devices) in both directions
+  static void connect(ttychan *a, ttychan *b);
+  unsigned long getRouteDrops(void) { return routedrops; }
+  unsigned long getRecordDrops(void) { return recdrops; }
   // clean up this vtty
   void cleanup(void);
-  // clean up all vttys
-  static void cleanupAll(void);
-  static void muxsync(void);
   static void setsync(bool state=true) { sync=state; }
+  // turn on flow control with a receive window of size bytes per channel
+  static void setcredits(bool state=true, int size=4096) { credits=state; window=size; }
   static int autodelete;  // set to 1 if delete symlinks when vtty closed or program exits
   static int nottysetup;  // set to 1 if you want to skip terminal setup on tty (still calls user routine)
   static int v2proto;
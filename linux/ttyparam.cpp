@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Get and set device parameters over the binary RPC channel (see muxrpc.h)
+// ttyparam rpc.virtual                 - list the parameters and their values
+// ttyparam rpc.virtual arate=100 note  - set arate and show note (all in one request)
+
+#include "muxrpc.h"
+
+static void Xerror(const char *msg, int rc=1)
+{
+  fprintf(stderr,"%s\n",msg);
+  exit(rc);
+}
+
+static const char *status(int st)
+{
+  static const char *msgs[]={"OK","not found","wrong type","too long","reply full","bad request","out of range"};
+  return st>=0 && st<=muxrpc::RPC_RANGE?msgs[st]:"?";
+}
+
+static void show(const char *name, muxrpc::item &it)
+{
+  if (it.status!=muxrpc::RPC_OK) printf("%s: %s\n",name,status(it.status));
+  else if (it.op==muxrpc::OP_SET) printf("%s: set\n",name);
+  else if (it.type==muxrpc::VAL_UINT) printf("%s=%u\n",name,it.num);
+  else if (it.type==muxrpc::VAL_STR) printf("%s=%s\n",name,it.str);
+}
+
+int main(int argc, char *argv[])
+{
+  muxrpc rpc;
+  muxrpc::request r;
+  muxrpc::reply a;
+  muxrpc::item it;
+  int asked[128], n=0;  // table index of each item, in order
+  if (argc<2) Xerror("Usage: ttyparam port [name[=value]...]\n   with no names, list the parameters");
+  if (rpc.open(argv[1])) Xerror("Can't open port",2);
+  if (rpc.discover()<0) Xerror("No answer from the device",3);
+  rpc.begin(r);
+  if (argc==2)
+    {
+      for (int i=0;i<rpc.count();i++)
+	if (rpc.type(i)!=muxrpc::VAL_NONE && r.get(i)) asked[n++]=i;
+    }
+  else for (int i=2;i<argc;i++)
+    {
+      char *eq=strchr(argv[i],'=');
+      int idx;
+      bool ok;
+      if (eq) *eq='\0';
+      idx=rpc.find(argv[i]);
+      if (idx<0 || rpc.type(idx)==muxrpc::VAL_NONE)
+	{
+	  fprintf(stderr,"No parameter %s\n",argv[i]);
+	  exit(4);
+	}
+      if (!eq) ok=r.get(idx);
+      else if (rpc.type(idx)==muxrpc::VAL_UINT) ok=r.set(idx,(uint32_t)strtoul(eq+1,NULL,0));
+      else ok=r.set(idx,eq+1);
+      if (!ok) Xerror("Too much for one request",4);
+      asked[n++]=idx;
+    }
+  if (rpc.send(r)<0 || rpc.recv(a)) Xerror("No answer from the device",3);
+  // items come back in the order we asked
+  for (int i=0;i<n && a.next(it);i++) show(rpc.name(asked[i]),it);
+  return 0;
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// CSV or binary records from telemetry frames (see ttytel.h and MuxTelemetry.h on the device)
+
+#include "ttytel.h"
+
+ttytelchan::ttytelchan(ttydev *dev, int mode) : ttychan(dev)
+{
+  this->mode=mode;
+  framelen=0;
+  tlast=0;
+  tbase=0;
+  samples=0;
+  errors=0;
+  insync=true;
+}
+
+// take a varint (false if the frame is too short)
+static bool takevar(const unsigned char *&p, const unsigned char *end, uint32_t *v)
+{
+  *v=0;
+  for (int shift=0;p<end;shift+=7)
+    {
+      if (shift<32) *v|=(uint32_t)(*p&0x7f)<<shift;
+      if (!(*p++&0x80)) return true;
+    }
+  return false;
+}
+
+// The header makes sense and the samples use up exactly the frame's bytes
+bool ttytelchan::check(const unsigned char *f)
+{
+  const unsigned char *p=f+1, *end=f+1+f[0];
+  uint32_t x;
+  int nvals, count;
+  if (end-p<6) return false;
+  nvals=p[0];
+  count=p[1];
+  if (nvals<1 || nvals>MAXVALS || count<1) return false;
+  p+=6;
+  for (int s=0;s<count;s++)
+    for (int i=s?-1:0;i<nvals;i++)   // dt (not for the first sample), then the values
+      if (!takevar(p,end,&x)) return false;
+  return p==end;
+}
+
+int ttytelchan::decode(const unsigned char *f, char *out, int size)
+{
+  const unsigned char *p=f+1, *end=f+1+f[0];
+  uint32_t v[MAXVALS], t, x;
+  int nvals, count, olen=0;
+  nvals=p[0];
+  count=p[1];
+  t=p[2]|(p[3]<<8)|(p[4]<<16)|((uint32_t)p[5]<<24);
+  p+=6;
+  for (int s=0;s<count;s++)
+    {
+      if (s)
+	{
+	  takevar(p,end,&x);
+	  t+=x;
+	}
+      for (int i=0;i<nvals;i++)
+	{
+	  takevar(p,end,&x);
+	  x=(x>>1)^-(x&1);   // undo zigzag
+	  v[i]=s?v[i]+x:x;
+	}
+      // device time only goes forward, so going back means it wrapped
+      if (t<tlast) tbase+=1ULL<<32;
+      tlast=t;
+      samples++;
+      if (mode==TEL_BINARY)
+	{
+	  ttytelrec rec;
+	  if (size-olen<(int)(sizeof(rec)+nvals*sizeof(int32_t))) break;
+	  rec.us=tbase+t;
+	  rec.n=nvals;
+	  memcpy(out+olen,&rec,sizeof(rec));
+	  memcpy(out+olen+sizeof(rec),v,nvals*sizeof(int32_t));
+	  olen+=sizeof(rec)+nvals*sizeof(int32_t);
+	  continue;
+	}
+      if (size-olen<24+nvals*12) break;
+      olen+=sprintf(out+olen,"%llu",(unsigned long long)(tbase+t));
+      for (int i=0;i<nvals;i++) olen+=sprintf(out+olen,",%d",(int32_t)v[i]);
+      out[olen++]='\n';
+    }
+  return olen;
+}
+
+// put frames together (they can be split across reads) and pass the samples on
+// A frame that doesn't check out loses its first byte and we look again from the next one
+void ttytelchan::deliver(const unsigned char *buf, int n, const struct timespec &ts)
+{
+  static const int OUTSIZE=65536;
+  char out[OUTSIZE];
+  int olen=0;
+  if (n<=0) return;
+  if (route || mode==TEL_NONE)
+    {
+      ttychan::deliver(buf,n,ts);
+      return;
+    }
+  while (n>0)
+    {
+      int want=sizeof(frame)-framelen, used=0;
+      if (want>n) want=n;
+      memcpy(frame+framelen,buf,want);
+      framelen+=want;
+      buf+=want;
+      n-=want;
+      // every whole frame we have, or the start of one whose header can't be right
+      // (so a garbage length byte doesn't keep us waiting for later frames' bytes)
+      while (framelen-used>0 && (framelen-used>=frame[used]+1 || frame[used]<6 ||
+				 (framelen-used>=2 && (frame[used+1]<1 || frame[used+1]>MAXVALS)) ||
+				 (framelen-used>=3 && frame[used+2]<1)))
+	{
+	  if (framelen-used<frame[used]+1 || !check(frame+used))
+	    {
+	      if (insync) errors++;
+	      insync=false;
+	      used++;
+	      continue;
+	    }
+	  insync=true;
+	  // a frame is under 256 bytes, so its samples always fit in half the buffer
+	  if (olen>OUTSIZE/2)
+	    {
+	      output((unsigned char *)out,olen,ts);
+	      olen=0;
+	    }
+	  olen+=decode(frame+used,out+olen,OUTSIZE/2);
+	  used+=frame[used]+1;
+	}
+      memmove(frame,frame+used,framelen-used);
+      framelen-=used;   // what's left is the start of a frame
+    }
+  if (olen) output((unsigned char *)out,olen,ts);
+  delivered(n);
+}
@@ -0,0 +1,55 @@
+#ifndef __TTYTEL_H
+#define __TTYTEL_H
+
+/*
+Telemetry frames (MuxTelemetry in the device code) turned into CSV or binary records.
+
+A frame is len nvals count t0(4) values [dt values]... (see MuxTelemetry.h). The first
+sample has the values as they are and later ones have the difference from the sample
+before, all as zigzag varints. dt is a varint in microseconds.
+
+TEL_CSV gives one line per sample: time in microseconds, then the values
+   1234567,2048,17
+TEL_BINARY gives a ttytelrec per sample followed by n int32_t values (host byte order)
+
+The device's 32 bit microsecond time wraps every 71 minutes; the time here keeps counting.
+
+Frames are only marked by their length byte, so if we start in the middle of one (or bytes
+are lost) a frame that doesn't check out is dropped a byte at a time until one does. Nothing
+of a bad frame reaches the pty.
+*/
+
+#include <stdint.h>
+#include "ttymux.h"
+
+// Record header for TEL_BINARY (host byte order)
+struct ttytelrec
+{
+  uint64_t us;   // device time in microseconds
+  uint32_t n;    // number of int32_t values following this header
+} __attribute__((packed));
+
+class ttytelchan : public ttychan
+{
+protected:
+  int mode;
+  unsigned char frame[512];  // received bytes not decoded yet (frame[0] is a frame's length)
+  int framelen;
+  uint32_t tlast;            // last device time we saw
+  uint64_t tbase;            // added to device times to undo wraps
+  unsigned long samples, errors;
+  bool insync;
+  void deliver(const unsigned char *buf, int n, const struct timespec &ts) override;
+  // is f (with its length byte) a whole frame that makes sense?
+  static bool check(const unsigned char *f);
+  // decode a frame that passed check into out, returns the length
+  int decode(const unsigned char *f, char *out, int size);
+public:
+  enum { TEL_NONE=0, TEL_CSV, TEL_BINARY };
+  enum { MAXVALS=16 };   // same as MuxTelemetry::MAXVALS
+  ttytelchan(ttydev *dev, int mode);
+  unsigned long getSamples(void) { return samples; }
+  unsigned long getErrors(void) { return errors; }   // times we lost our place in the frames
+};
+
+#endif